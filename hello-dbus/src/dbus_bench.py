@@ -0,0 +1,596 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2013 Canonical, Ltd.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+"""End-to-end benchmark of dbus_message against dbus_service.
+
+Starts a private dbus-daemon from a generated config on a socket in a
+temporary directory, starts dbus_service on it (waiting on --lock-fd for the
+name to be acquired) and runs a matrix of dbus_message workloads: signals and
+method calls, several payloads and several concurrent clients. Nothing but
+dbus-daemon and the binaries built here is needed, and no network.
+
+Results are written as JSON and compared against a stored baseline. Each
+workload runs several times and every gated metric (throughput, median
+latency, CPU per message) is the median of the runs, and their noise is
+estimated from the median absolute deviation. A metric worse than the
+baseline by more than the threshold plus the noise of both, capped at
+--max-noise, is reported and makes the run fail. Baselines are only meaningful on the machine and with the options
+they were recorded with: against a baseline from another host regressions
+are only reported, and against one recorded with other options nothing is
+compared. Record one with --update-baseline before comparing.
+
+With --streams, the Upload and Download streams are measured instead, in
+MB/s against chunk size and window, and with --batches the cost per Method
+call against the number of calls packed in each Batch call. Neither is
+compared.
+"""
+
+import argparse
+import fcntl
+import json
+import math
+import os
+import platform
+import resource
+import subprocess
+import sys
+import tempfile
+import time
+
+SERVICE_NAME = "com.canonical.hello-dbus-fwk"
+OBJECT_PATH = "/com/canonical/HelloDbusFramework/DbusSrv"
+INTERFACE = "com.canonical.HelloDbusFramework.DbusSrv"
+
+SRC_DIR = os.path.dirname(os.path.abspath(__file__))
+
+BUS_CONFIG = """<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>session</type>
+  <listen>unix:path={socket}</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow send_destination="*" eavesdrop="true"/>
+    <allow eavesdrop="true"/>
+    <allow own="*"/>
+  </policy>
+  <limit name="max_incoming_bytes">1000000000</limit>
+  <limit name="max_outgoing_bytes">1000000000</limit>
+  <limit name="max_message_size">134217728</limit>
+  <limit name="max_replies_per_connection">50000</limit>
+  <limit name="reply_timeout">300000</limit>
+</busconfig>
+"""
+
+PAYLOADS = {
+    "none": [],
+    "int32": ["int32:42"],
+    "string-64": ["string:" + "x" * 64],
+    "string-4096": ["string:" + "x" * 4096],
+    "array-int32-1024": ["array:int32:" + ",".join(str(i) for i in range(1024))],
+    "dict-string-int32-64":
+        ["dict:string:int32:" + ",".join("k%d,%d" % (i, i) for i in range(64))],
+}
+
+KINDS = {
+    "signal": ("signal", "Signal"),
+    "method": ("method_call", "Method"),
+}
+
+STREAM_DIRECTIONS = ["Upload", "Download"]
+STREAM_CHUNKS = [4096, 65536, 1048576]
+STREAM_WINDOWS = [1, 4, 16]
+
+# 0 sends the calls unbatched
+BATCH_SIZES = [0, 1, 4, 16, 64, 256]
+
+# Compared against the baseline: name, True when higher is better
+GATED_METRICS = [
+    ("throughput_msg_s", True),
+    ("latency_p50_us", False),
+    ("cpu_us_per_msg", False),
+]
+
+
+def proc_cpu_seconds(pid):
+    """CPU time of a running process. /proc/<pid>/schedstat is in ns, while
+    utime + stime from /proc/<pid>/stat only have clock tick resolution."""
+    try:
+        with open("/proc/%d/schedstat" % pid) as f:
+            return int(f.read().split()[0]) / 1e9
+    except (OSError, IndexError, ValueError):
+        pass
+    with open("/proc/%d/stat" % pid) as f:
+        # The command may contain spaces, so split after the closing paren
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def children_cpu_seconds():
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return None
+    index = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+class PrivateBus:
+    """A dbus-daemon and a dbus_service, both torn down on exit"""
+
+    def __init__(self, tmpdir, service, service_args, bus_config=BUS_CONFIG,
+                 service_stdout=subprocess.DEVNULL):
+        self.tmpdir = tmpdir
+        self.daemon = None
+        self.service = None
+        self.service_stdout = service_stdout
+
+        config = os.path.join(tmpdir, "bus.conf")
+        with open(config, "w") as f:
+            f.write(bus_config.format(socket=os.path.join(tmpdir, "bus.sock")))
+
+        self.daemon = subprocess.Popen(
+            ["dbus-daemon", "--config-file=" + config, "--nofork",
+             "--print-address=1"],
+            stdout=subprocess.PIPE, universal_newlines=True)
+        self.address = self.daemon.stdout.readline().strip()
+        if not self.address:
+            raise RuntimeError("dbus-daemon didn't start")
+
+        self.service = self.start_service(service, service_args)
+
+    def start_service(self, service, service_args):
+        """Starts dbus_service holding a lock that it releases once it owns
+        its name, and waits for that"""
+        lock_path = os.path.join(self.tmpdir, "service.lock")
+        lock_fd = os.open(lock_path, os.O_RDWR | os.O_CREAT, 0o600)
+        fcntl.flock(lock_fd, fcntl.LOCK_EX)
+
+        proc = subprocess.Popen(
+            [service, "--address=" + self.address, "--name=" + SERVICE_NAME,
+             "--lock-fd=%d" % lock_fd] + service_args +
+            [OBJECT_PATH, INTERFACE],
+            pass_fds=(lock_fd,), stdout=self.service_stdout)
+        os.close(lock_fd)
+
+        wait_fd = os.open(lock_path, os.O_RDWR)
+        deadline = time.monotonic() + 10
+        try:
+            while True:
+                try:
+                    fcntl.flock(wait_fd, fcntl.LOCK_EX | fcntl.LOCK_NB)
+                    break
+                except BlockingIOError:
+                    if proc.poll() is not None:
+                        raise RuntimeError("dbus_service exited with %d" % proc.returncode)
+                    if time.monotonic() > deadline:
+                        proc.kill()
+                        raise RuntimeError("dbus_service didn't acquire its name")
+                    time.sleep(0.005)
+        finally:
+            os.close(wait_fd)
+
+        return proc
+
+    def close(self):
+        for proc in (self.service, self.daemon):
+            if proc and proc.poll() is None:
+                proc.terminate()
+                try:
+                    proc.wait(timeout=10)
+                except subprocess.TimeoutExpired:
+                    proc.kill()
+                    proc.wait()
+        if self.daemon:
+            self.daemon.stdout.close()
+
+
+def run_workload(bus, args, kind, payload, concurrency):
+    message_type, member = KINDS[kind]
+    count = max(args.count // concurrency, 1)
+    stats = [os.path.join(bus.tmpdir, "stats.%d" % i) for i in range(concurrency)]
+
+    cpu_clients = children_cpu_seconds()
+    cpu_service = proc_cpu_seconds(bus.service.pid)
+    cpu_daemon = proc_cpu_seconds(bus.daemon.pid)
+    start = time.monotonic()
+
+    clients = [subprocess.Popen(
+        [args.dbus_message, "--address=" + bus.address, "--name=" + SERVICE_NAME,
+         "--type=" + message_type, "--count=%d" % count,
+         "--window=%d" % args.window, "--stats=" + stats[i],
+         OBJECT_PATH, INTERFACE + "." + member] + PAYLOADS[payload],
+        stdout=subprocess.DEVNULL) for i in range(concurrency)]
+    failed = [c.args for c in clients if c.wait() != 0]
+
+    wall = time.monotonic() - start
+    cpu_clients = children_cpu_seconds() - cpu_clients
+    cpu_service = proc_cpu_seconds(bus.service.pid) - cpu_service
+    cpu_daemon = proc_cpu_seconds(bus.daemon.pid) - cpu_daemon
+
+    if failed:
+        raise RuntimeError("dbus_message failed: %s" % " ".join(failed[0]))
+
+    latencies = []
+    for path in stats:
+        with open(path) as f:
+            latencies.extend(int(line) / 1000.0 for line in f)
+        os.unlink(path)
+    latencies.sort()
+
+    messages = count * concurrency
+    return {
+        "kind": kind,
+        "payload": payload,
+        "concurrency": concurrency,
+        "messages": messages,
+        "wall_s": round(wall, 6),
+        "throughput_msg_s": round(messages / wall, 1),
+        "latency_p50_us": percentile(latencies, 50),
+        "latency_p90_us": percentile(latencies, 90),
+        "latency_p99_us": percentile(latencies, 99),
+        "latency_max_us": latencies[-1] if latencies else None,
+        "cpu_us_per_msg": round((cpu_clients + cpu_service + cpu_daemon) / messages * 1e6, 2),
+        "cpu_client_us_per_msg": round(cpu_clients / messages * 1e6, 2),
+        "cpu_service_us_per_msg": round(cpu_service / messages * 1e6, 2),
+        "cpu_daemon_us_per_msg": round(cpu_daemon / messages * 1e6, 2),
+    }
+
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def relative_noise(values):
+    """Returns 1.4826 * MAD / median: the relative standard deviation the
+    values would have if they were normal, which a single outlier run can't
+    inflate the way it inflates their range"""
+    m = median(values)
+    if not m:
+        return 0
+    return round(1.4826 * median(abs(v - m) for v in values) / m, 3)
+
+
+def summarize(result, samples):
+    """Sets the gated metrics of result to the median of their samples, and
+    their noise"""
+    result["samples"] = samples
+    result["noise"] = {}
+    for metric, values in samples.items():
+        result[metric] = median(values)
+        result["noise"][metric] = relative_noise(values)
+    return result
+
+
+def run_repeated(bus, args, kind, payload, concurrency):
+    """Runs the workload args.repeat times. The gated metrics are the median
+    of the runs, which is steadier than any single run on a busy machine"""
+    runs = [run_workload(bus, args, kind, payload, concurrency)
+            for _ in range(args.repeat)]
+    runs.sort(key=lambda r: r["throughput_msg_s"])
+    result = runs[len(runs) // 2]
+    result["repeat"] = args.repeat
+    samples = {}
+    for metric, _ in GATED_METRICS:
+        values = [r[metric] for r in runs if r[metric] is not None]
+        if values:
+            samples[metric] = values
+    return summarize(result, samples)
+
+
+def run_matrix(args):
+    """Runs every workload on a new private bus"""
+    results = {}
+    with tempfile.TemporaryDirectory(prefix="dbus_bench.") as tmpdir:
+        bus = PrivateBus(tmpdir, args.dbus_service, args.service_arg)
+        try:
+            for kind in args.kinds.split(","):
+                for payload in args.payloads.split(","):
+                    for concurrency in (int(c) for c in args.concurrency.split(",")):
+                        key = "%s/%s/c%d" % (kind, payload, concurrency)
+                        results[key] = run_repeated(bus, args, kind, payload, concurrency)
+        finally:
+            bus.close()
+    return results
+
+
+def merge_sessions(sessions):
+    """Combines several runs of the whole matrix. The runs of all sessions
+    are pooled, so that the noise of a baseline also covers what changes from
+    one bus and one service process to the next"""
+    if len(sessions) == 1:
+        return sessions[0]
+    merged = {}
+    for key in sessions[0]:
+        runs = sorted((s[key] for s in sessions), key=lambda r: r["throughput_msg_s"])
+        result = dict(runs[len(runs) // 2])
+        result["sessions"] = len(runs)
+        samples = {}
+        for run in runs:
+            for metric, values in run["samples"].items():
+                samples.setdefault(metric, []).extend(values)
+        merged[key] = summarize(result, samples)
+    return merged
+
+
+def run_stream(bus, args, direction, chunk, window):
+    cpu_clients = children_cpu_seconds()
+    cpu_service = proc_cpu_seconds(bus.service.pid)
+    cpu_daemon = proc_cpu_seconds(bus.daemon.pid)
+
+    client = subprocess.run(
+        [args.dbus_message, "--address=" + bus.address, "--name=" + SERVICE_NAME,
+         "--stream=%d" % args.stream_size, "--chunk=%d" % chunk,
+         "--window=%d" % window, OBJECT_PATH, INTERFACE + "." + direction],
+        stdout=subprocess.PIPE, universal_newlines=True)
+    if client.returncode != 0:
+        raise RuntimeError("dbus_message failed: %s" % " ".join(client.args))
+
+    cpu = (children_cpu_seconds() - cpu_clients +
+           proc_cpu_seconds(bus.service.pid) - cpu_service +
+           proc_cpu_seconds(bus.daemon.pid) - cpu_daemon)
+
+    # "streamed N bytes in S s (R MB/s)"
+    words = client.stdout.split()
+    seconds = float(words[words.index("streamed") + 4])
+    return {
+        "direction": direction,
+        "chunk": chunk,
+        "window": window,
+        "bytes": args.stream_size,
+        "wall_s": seconds,
+        "throughput_mb_s": round(args.stream_size / seconds / 1e6, 1),
+        "cpu_s_per_gb": round(cpu / args.stream_size * 1e9, 3),
+    }
+
+
+def run_streams(bus, args):
+    results = {}
+    for direction in STREAM_DIRECTIONS:
+        for chunk in STREAM_CHUNKS:
+            for window in STREAM_WINDOWS:
+                runs = [run_stream(bus, args, direction, chunk, window)
+                        for _ in range(args.repeat)]
+                runs.sort(key=lambda r: r["throughput_mb_s"])
+                key = "%s/chunk%d/w%d" % (direction.lower(), chunk, window)
+                results[key] = runs[len(runs) // 2]
+    return results
+
+
+def print_stream_table(results):
+    print("%-40s %10s %12s" % ("stream", "MB/s", "cpu s/GB"))
+    for key, r in results.items():
+        print("%-40s %10.1f %12.3f" % (key, r["throughput_mb_s"], r["cpu_s_per_gb"]))
+
+
+def run_batch(bus, args, size, payload):
+    calls = max(args.count // max(size, 1), 1) * max(size, 1)
+    batch_args = ["--batch=%d" % size] if size else []
+
+    cpu_clients = children_cpu_seconds()
+    cpu_service = proc_cpu_seconds(bus.service.pid)
+    cpu_daemon = proc_cpu_seconds(bus.daemon.pid)
+    start = time.monotonic()
+
+    client = subprocess.run(
+        [args.dbus_message, "--address=" + bus.address, "--name=" + SERVICE_NAME,
+         "--type=method_call", "--count=%d" % calls] + batch_args +
+        [OBJECT_PATH, INTERFACE + ".Method"] + PAYLOADS[payload],
+        stdout=subprocess.DEVNULL)
+    if client.returncode != 0:
+        raise RuntimeError("dbus_message failed: %s" % " ".join(client.args))
+
+    wall = time.monotonic() - start
+    cpu = (children_cpu_seconds() - cpu_clients +
+           proc_cpu_seconds(bus.service.pid) - cpu_service +
+           proc_cpu_seconds(bus.daemon.pid) - cpu_daemon)
+    return {
+        "batch": size,
+        "payload": payload,
+        "calls": calls,
+        "wall_s": round(wall, 6),
+        "wall_us_per_call": round(wall / calls * 1e6, 2),
+        "cpu_us_per_call": round(cpu / calls * 1e6, 2),
+    }
+
+
+def run_batches(bus, args):
+    results = {}
+    for payload in args.payloads.split(","):
+        for size in BATCH_SIZES:
+            runs = [run_batch(bus, args, size, payload) for _ in range(args.repeat)]
+            runs.sort(key=lambda r: r["wall_us_per_call"])
+            key = "%s/%s" % ("batch%d" % size if size else "unbatched", payload)
+            results[key] = runs[len(runs) // 2]
+    return results
+
+
+def print_batch_table(results):
+    print("%-40s %12s %12s" % ("calls", "wall us/call", "cpu us/call"))
+    for key, r in results.items():
+        print("%-40s %12.2f %12.2f" % (key, r["wall_us_per_call"], r["cpu_us_per_call"]))
+
+
+def compare(results, baseline, threshold, max_noise):
+    """Returns the list of regressions of results against baseline. Each
+    metric tolerates threshold plus the combined noise of its runs in both,
+    but never more than threshold plus max_noise: a noisy workload is still
+    gated"""
+    regressions = []
+    for key, result in sorted(results.items()):
+        base = baseline.get(key)
+        if base is None:
+            continue
+        for metric, higher_is_better in GATED_METRICS:
+            new, old = result.get(metric), base.get(metric)
+            if not new or not old:
+                continue
+            noise = math.hypot(base.get("noise", {}).get(metric, 0),
+                               result.get("noise", {}).get(metric, 0))
+            tolerance = threshold + min(noise, max_noise)
+            change = (new - old) / old
+            if (higher_is_better and change < -tolerance) or \
+               (not higher_is_better and change > tolerance):
+                regressions.append("%s: %s %g -> %g (%+.1f%%, tolerated %.0f%%)" %
+                                   (key, metric, old, new, change * 100,
+                                    tolerance * 100))
+    return regressions
+
+
+def print_table(results):
+    print("%-40s %10s %9s %9s %9s %9s" %
+          ("workload", "msg/s", "p50 us", "p90 us", "p99 us", "cpu us/msg"))
+    for key, r in results.items():
+        def fmt(v):
+            return "-" if v is None else "%.1f" % v
+        print("%-40s %10.0f %9s %9s %9s %9.2f" %
+              (key, r["throughput_msg_s"], fmt(r["latency_p50_us"]),
+               fmt(r["latency_p90_us"]), fmt(r["latency_p99_us"]),
+               r["cpu_us_per_msg"]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--dbus-message", default=os.path.join(SRC_DIR, "dbus_message"))
+    parser.add_argument("--dbus-service", default=os.path.join(SRC_DIR, "dbus_service"))
+    parser.add_argument("--service-arg", action="append", default=[],
+                        help="extra dbus_service argument (repeatable)")
+    parser.add_argument("--kinds", default=",".join(KINDS))
+    parser.add_argument("--payloads", default=",".join(PAYLOADS))
+    parser.add_argument("--concurrency", default="1,4,16",
+                        help="comma separated numbers of concurrent clients")
+    parser.add_argument("--count", type=int, default=4000,
+                        help="messages per workload, split between the clients")
+    parser.add_argument("--repeat", type=int, default=5,
+                        help="runs per workload, the median is kept (default 5)")
+    parser.add_argument("--window", type=int, default=1,
+                        help="method calls in flight per client")
+    parser.add_argument("--output", default="bench_results.json")
+    parser.add_argument("--baseline", default=os.path.join(SRC_DIR, "bench_baseline.json"))
+    parser.add_argument("--threshold", type=float, default=0.20,
+                        help="tolerated relative regression (default 0.20)")
+    parser.add_argument("--max-noise", type=float, default=0.10,
+                        help="most measured noise added to the threshold "
+                        "(default 0.10)")
+    parser.add_argument("--sessions", type=int,
+                        help="runs of the whole matrix, each on a new bus "
+                        "(default 3 with --update-baseline, else 1)")
+    parser.add_argument("--update-baseline", action="store_true",
+                        help="store the results as the new baseline")
+    parser.add_argument("--no-compare", action="store_true",
+                        help="only run the workloads, e.g. for PGO training")
+    parser.add_argument("--streams", action="store_true",
+                        help="measure Upload and Download streams instead")
+    parser.add_argument("--stream-size", type=int, default=64 * 1024 * 1024,
+                        help="bytes per stream (default 64 MiB)")
+    parser.add_argument("--batches", action="store_true",
+                        help="measure the cost per call against the Batch size instead")
+    args = parser.parse_args()
+
+    if args.streams or args.batches:
+        with tempfile.TemporaryDirectory(prefix="dbus_bench.") as tmpdir:
+            bus = PrivateBus(tmpdir, args.dbus_service, args.service_arg)
+            try:
+                if args.streams:
+                    results = run_streams(bus, args)
+                else:
+                    results = run_batches(bus, args)
+            finally:
+                bus.close()
+        with open(args.output, "w") as f:
+            json.dump({"config": {"stream_size": args.stream_size,
+                                  "count": args.count,
+                                  "repeat": args.repeat},
+                       "streams" if args.streams else "batches": results},
+                      f, indent=2, sort_keys=True)
+        if args.streams:
+            print_stream_table(results)
+        else:
+            print_batch_table(results)
+        print("\nwrote %s" % args.output)
+        return 0
+
+    sessions = args.sessions or (3 if args.update_baseline else 1)
+    results = merge_sessions([run_matrix(args) for _ in range(sessions)])
+
+    report = {
+        "host": {
+            "machine": platform.machine(),
+            "kernel": platform.release(),
+            "cpus": os.cpu_count(),
+        },
+        "config": {
+            "count": args.count,
+            "repeat": args.repeat,
+            "window": args.window,
+            "service_args": args.service_arg,
+        },
+        "results": results,
+    }
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+    print_table(results)
+    print("\nwrote %s" % args.output)
+
+    if args.update_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+        print("updated %s" % args.baseline)
+        return 0
+
+    if args.no_compare:
+        return 0
+
+    if not os.path.exists(args.baseline):
+        print("no baseline at %s, not comparing" % args.baseline)
+        return 0
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    # The number of repeats only changes the noise, which is accounted for
+    base_config = dict(baseline.get("config", {}), repeat=args.repeat)
+    if base_config != report["config"]:
+        print("\nbaseline recorded with %s, this run used %s, not comparing" %
+              (baseline.get("config"), report["config"]))
+        return 0
+    foreign = baseline.get("host") != report["host"]
+    if foreign:
+        print("\nwarning: baseline recorded on %s, this is %s, only reporting" %
+              (baseline.get("host"), report["host"]))
+
+    regressions = compare(results, baseline["results"], args.threshold,
+                          args.max_noise)
+    if regressions:
+        print("\n%s: %d regression(s) beyond %.0f%% plus noise against %s" %
+              ("WARNING" if foreign else "FAIL", len(regressions),
+               args.threshold * 100, args.baseline))
+        for r in regressions:
+            print("  " + r)
+        return 0 if foreign else 1
+
+    print("PASS: no regression beyond %.0f%% plus noise against %s" %
+          (args.threshold * 100, args.baseline))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
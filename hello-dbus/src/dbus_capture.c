@@ -0,0 +1,240 @@
+/* dbus_capture.c
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dbus_capture.h"
+#include "dbus_common.h"
+
+/* Reads are buffered; writes are flushed after each record */
+#define CAPTURE_BUFSIZ (256 * 1024)
+
+struct capture_file {
+	FILE *file;
+	const char *path;
+	struct capture_header header;
+
+	/* Reading only: holds the current record, grown up to the largest
+	 * record seen so memory stays bounded by the largest message rather
+	 * than the size of the capture.
+	 */
+	char *buf;
+	uint32_t buf_size;
+};
+
+static capture_file *capture_new(const char *path, const char *mode)
+{
+	capture_file *capture;
+
+	capture = calloc(1, sizeof(*capture));
+	if (capture == NULL) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		return NULL;
+	}
+
+	capture->path = path;
+	capture->file = fopen(path, mode);
+	if (capture->file == NULL) {
+		fprintf(stderr, "FAIL: Couldn't open capture file \"%s\": %m\n",
+			path);
+		free(capture);
+		return NULL;
+	}
+	setvbuf(capture->file, NULL, _IOFBF, CAPTURE_BUFSIZ);
+
+	return capture;
+}
+
+capture_file *capture_open_write(const char *path)
+{
+	capture_file *capture;
+	struct timespec ts;
+
+	capture = capture_new(path, "w");
+	if (capture == NULL)
+		return NULL;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	memcpy(capture->header.magic, CAPTURE_MAGIC,
+	       sizeof(capture->header.magic));
+	capture->header.version = CAPTURE_VERSION;
+	capture->header.start_realtime_ns =
+	    ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	capture->header.start_monotonic_ns = monotonic_ns();
+
+	if (fwrite(&capture->header, sizeof(capture->header), 1,
+		   capture->file) != 1) {
+		fprintf(stderr, "FAIL: Couldn't write capture file \"%s\": %m\n",
+			path);
+		capture_close(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+/**
+ * Appends message to the capture and writes it out, so that a capture of a
+ * service that crashes ends with the last message it handled. Returns -1
+ * upon error.
+ */
+int capture_write(capture_file * capture, int direction, DBusMessage * message)
+{
+	struct capture_record record;
+	char *data;
+	int len;
+
+	if (capture == NULL)
+		return 0;
+
+	if (!dbus_message_marshal(message, &data, &len)) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		return -1;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.timestamp_ns = monotonic_ns();
+	record.length = len;
+	record.direction = direction;
+
+	if (fwrite(&record, sizeof(record), 1, capture->file) != 1 ||
+	    fwrite(data, 1, len, capture->file) != (size_t)len ||
+	    fflush(capture->file) != 0) {
+		fprintf(stderr, "FAIL: Couldn't write capture file \"%s\": %m\n",
+			capture->path);
+		dbus_free(data);
+		return -1;
+	}
+
+	dbus_free(data);
+	return 0;
+}
+
+capture_file *capture_open_read(const char *path)
+{
+	capture_file *capture;
+
+	capture = capture_new(path, "r");
+	if (capture == NULL)
+		return NULL;
+
+	if (fread(&capture->header, sizeof(capture->header), 1,
+		  capture->file) != 1 ||
+	    memcmp(capture->header.magic, CAPTURE_MAGIC,
+		   sizeof(CAPTURE_MAGIC)) != 0) {
+		fprintf(stderr, "FAIL: \"%s\" is not a capture file\n", path);
+		capture_close(capture);
+		return NULL;
+	}
+
+	if (capture->header.version != CAPTURE_VERSION) {
+		fprintf(stderr,
+			"FAIL: Unsupported capture file version %u in \"%s\"\n",
+			capture->header.version, path);
+		capture_close(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+const struct capture_header *capture_get_header(capture_file * capture)
+{
+	return &capture->header;
+}
+
+/**
+ * Reads the next record and demarshals it into a new message owned by the
+ * caller. Returns 1 when a record was read, 0 at the end of the capture and
+ * -1 upon error.
+ */
+int capture_read(capture_file * capture, struct capture_record *record,
+		 DBusMessage ** message)
+{
+	DBusError error;
+
+	if (fread(record, sizeof(*record), 1, capture->file) != 1) {
+		if (feof(capture->file))
+			return 0;
+		fprintf(stderr, "FAIL: Couldn't read capture file \"%s\": %m\n",
+			capture->path);
+		return -1;
+	}
+
+	if (record->length > DBUS_MAXIMUM_MESSAGE_LENGTH) {
+		fprintf(stderr,
+			"FAIL: Corrupted record of %u bytes in \"%s\"\n",
+			record->length, capture->path);
+		return -1;
+	}
+
+	if (record->length > capture->buf_size) {
+		char *buf = realloc(capture->buf, record->length);
+
+		if (buf == NULL) {
+			fprintf(stderr, "FAIL: Not enough memory\n");
+			return -1;
+		}
+		capture->buf = buf;
+		capture->buf_size = record->length;
+	}
+
+	if (fread(capture->buf, 1, record->length, capture->file) !=
+	    record->length) {
+		fprintf(stderr, "FAIL: Truncated record in \"%s\"\n",
+			capture->path);
+		return -1;
+	}
+
+	dbus_error_init(&error);
+	*message = dbus_message_demarshal(capture->buf, record->length, &error);
+	if (*message == NULL) {
+		fprintf(stderr, "FAIL: %s: %s\n", error.name, error.message);
+		dbus_error_free(&error);
+		return -1;
+	}
+
+	return 1;
+}
+
+/**
+ * Returns -1 if the capture couldn't be written out
+ */
+int capture_close(capture_file * capture)
+{
+	int rc = 0;
+
+	if (capture == NULL)
+		return 0;
+
+	if (fclose(capture->file) != 0) {
+		fprintf(stderr, "FAIL: Couldn't write capture file \"%s\": %m\n",
+			capture->path);
+		rc = -1;
+	}
+	free(capture->buf);
+	free(capture);
+
+	return rc;
+}
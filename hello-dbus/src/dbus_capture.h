@@ -0,0 +1,67 @@
+/* dbus_capture.h
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Traffic capture files, written by dbus_service --capture and read back by
+ * dbus_replay.
+ *
+ * A capture file is a capture_header followed by one capture_record per
+ * message, each immediately followed by record.length bytes of the message
+ * in D-Bus wire format (as produced by dbus_message_marshal()). All fields
+ * are in host byte order.
+ */
+
+#ifndef DBUS_CAPTURE_H
+#define DBUS_CAPTURE_H
+
+#include <stdint.h>
+#include <dbus/dbus.h>
+
+#define CAPTURE_MAGIC "DBUSCAP"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_RECEIVED 0
+#define CAPTURE_SENT 1
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	int64_t start_realtime_ns;	/* CLOCK_REALTIME when capture started */
+	int64_t start_monotonic_ns;	/* CLOCK_MONOTONIC at the same time */
+};
+
+struct capture_record {
+	int64_t timestamp_ns;	/* CLOCK_MONOTONIC */
+	uint32_t length;
+	uint8_t direction;	/* CAPTURE_RECEIVED or CAPTURE_SENT */
+	uint8_t reserved[3];
+};
+
+typedef struct capture_file capture_file;
+
+capture_file *capture_open_write(const char *path);
+int capture_write(capture_file * capture, int direction, DBusMessage * message);
+capture_file *capture_open_read(const char *path);
+const struct capture_header *capture_get_header(capture_file * capture);
+int capture_read(capture_file * capture, struct capture_record *record,
+		 DBusMessage ** message);
+int capture_close(capture_file * capture);
+
+#endif /* DBUS_CAPTURE_H */
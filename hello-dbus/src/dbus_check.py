@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2013 Canonical, Ltd.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+"""Checks that misbehaving clients can't take dbus_service down.
+
+Each check starts dbus_service on a private bus with the limits of the
+system bus and a --log file, lets a client misbehave, then requires the
+service to still be running and serving well behaved clients.
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import zlib
+
+from dbus_bench import PrivateBus, SERVICE_NAME, OBJECT_PATH, INTERFACE, SRC_DIR
+from dbus_soak import SOAK_BUS_CONFIG
+
+
+def c_define(source, name):
+    """Returns the value of a numeric #define in one of the sources here, so
+    the checks follow the limits the service is built with"""
+    with open(os.path.join(SRC_DIR, source)) as f:
+        for line in f:
+            m = re.match(r"#define\s+%s\s+([\d\s()*+<-]+)$" % name, line.strip())
+            if m:
+                return int(eval(m.group(1), {"__builtins__": {}}))
+    raise ValueError("no numeric #define %s in %s" % (name, source))
+
+
+STREAM_MAX_CHUNK = c_define("dbus_stream.h", "STREAM_MAX_CHUNK")
+MAX_STREAMS = c_define("dbus_service.c", "MAX_STREAMS")
+
+
+def dbus_message(args, bus, *argv):
+    return subprocess.run(
+        [args.dbus_message, "--address=" + bus.address, "--name=" + SERVICE_NAME] +
+        list(argv), stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+        universal_newlines=True)
+
+
+def still_serving(args, bus):
+    """Returns an error when the service stopped or no longer answers"""
+    if bus.service.poll() is not None:
+        return "dbus_service exited with %d" % bus.service.returncode
+    call = dbus_message(args, bus, "--type=method_call", OBJECT_PATH,
+                        INTERFACE + ".Method")
+    if call.returncode != 0:
+        return "Method failed: %s" % call.stderr.strip()
+    upload = dbus_message(args, bus, "--stream=1K", "--chunk=256", OBJECT_PATH,
+                          INTERFACE + ".Upload")
+    if upload.returncode != 0:
+        return "Upload failed: %s" % upload.stderr.strip()
+    return None
+
+
+def abandon_upload(bus, stream_id):
+    """Starts an upload with dbus-send, which leaves the bus right after"""
+    data = bytes(range(1, 9))
+    return subprocess.run(
+        ["dbus-send", "--bus=" + bus.address, "--dest=" + SERVICE_NAME,
+         "--type=method_call", "--print-reply", OBJECT_PATH,
+         INTERFACE + ".Upload", "uint64:%d" % stream_id, "uint64:0",
+         "array:byte:" + ",".join(str(b) for b in data),
+         "uint32:%d" % zlib.adler32(data)],
+        stdout=subprocess.DEVNULL, stderr=subprocess.PIPE,
+        universal_newlines=True)
+
+
+def check_abandoned_uploads(args, bus, log):
+    """Clients that start an upload and leave must not use up the streams"""
+    for i in range(MAX_STREAMS + 8):
+        upload = abandon_upload(bus, i)
+        if upload.returncode != 0:
+            return "abandoned upload %d failed: %s" % (i + 1, upload.stderr.strip())
+    return None
+
+
+def check_disconnects_unlogged(args, bus, log):
+    """Clients leaving the bus, with or without uploads, don't show up in the
+    log, which must only hold the messages of the clients"""
+    for i in range(4):
+        abandon_upload(bus, i)
+        dbus_message(args, bus, "--type=method_call", OBJECT_PATH,
+                     INTERFACE + ".Method")
+    with open(log) as f:
+        logged = [line.strip() for line in f if "NameOwnerChanged" in line]
+    if logged:
+        return "%d NameOwnerChanged signals logged, first: %s" % (len(logged), logged[0])
+    return None
+
+
+def check_oversized_batch(args, bus, log):
+    """A Batch whose reply would exceed the message size limit fails with
+    LimitsExceeded instead of getting the service disconnected"""
+    batch = dbus_message(args, bus, "--type=method_call", "--count=3",
+                         "--batch=3", OBJECT_PATH, INTERFACE + ".Download",
+                         "uint64:0", "uint32:%d" % STREAM_MAX_CHUNK)
+    if batch.returncode == 0:
+        return "Batch of %d MiB succeeded" % (3 * STREAM_MAX_CHUNK >> 20)
+    if "LimitsExceeded" not in batch.stderr:
+        return "Batch failed with: %s" % batch.stderr.strip()
+    return None
+
+
+CHECKS = [
+    check_abandoned_uploads,
+    check_disconnects_unlogged,
+    check_oversized_batch,
+]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--dbus-message", default=os.path.join(SRC_DIR, "dbus_message"))
+    parser.add_argument("--dbus-service", default=os.path.join(SRC_DIR, "dbus_service"))
+    args = parser.parse_args()
+
+    failures = 0
+    for check in CHECKS:
+        with tempfile.TemporaryDirectory(prefix="dbus_check.") as tmpdir:
+            log = os.path.join(tmpdir, "service.log")
+            bus = PrivateBus(tmpdir, args.dbus_service, ["--log=" + log],
+                             bus_config=SOAK_BUS_CONFIG)
+            try:
+                error = check(args, bus, log) or still_serving(args, bus)
+            finally:
+                bus.close()
+        if error:
+            print("FAIL: %s: %s" % (check.__name__, error))
+            failures += 1
+        else:
+            print("ok %s" % check.__name__)
+
+    if failures:
+        return 1
+    print("PASS")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
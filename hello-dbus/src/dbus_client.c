@@ -0,0 +1,405 @@
+/* dbus_client.c
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dbus_client.h"
+
+struct client_timeout {
+	DBusTimeout *timeout;
+	long long deadline;	/* CLOCK_MONOTONIC, in ms */
+};
+
+struct dbus_client {
+	DBusConnection *connection;
+	dbus_client_message_cb handler;
+	void *handler_data;
+	int pending;
+	long long read_ns;	/* CLOCK_MONOTONIC, when the last read returned */
+
+	/* libdbus only implements call timeouts through the main loop
+	 * integration, so keep track of them here.
+	 */
+	struct client_timeout *timeouts;
+	int n_timeouts;
+	int max_timeouts;
+};
+
+struct client_call {
+	dbus_client *client;
+	dbus_client_reply_cb cb;
+	void *user_data;
+};
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static dbus_bool_t add_timeout(DBusTimeout * timeout, void *data)
+{
+	dbus_client *client = data;
+	struct client_timeout *t;
+
+	if (client->n_timeouts == client->max_timeouts) {
+		int max = client->max_timeouts ? client->max_timeouts * 2 : 16;
+
+		t = realloc(client->timeouts, max * sizeof(*t));
+		if (t == NULL)
+			return FALSE;
+		client->timeouts = t;
+		client->max_timeouts = max;
+	}
+
+	t = &client->timeouts[client->n_timeouts++];
+	t->timeout = timeout;
+	t->deadline = now_ms() + dbus_timeout_get_interval(timeout);
+
+	return TRUE;
+}
+
+static void remove_timeout(DBusTimeout * timeout, void *data)
+{
+	dbus_client *client = data;
+	int i;
+
+	for (i = 0; i < client->n_timeouts; i++) {
+		if (client->timeouts[i].timeout == timeout) {
+			client->timeouts[i] =
+			    client->timeouts[--client->n_timeouts];
+			return;
+		}
+	}
+}
+
+static void toggle_timeout(DBusTimeout * timeout, void *data)
+{
+	dbus_client *client = data;
+	int i;
+
+	for (i = 0; i < client->n_timeouts; i++) {
+		if (client->timeouts[i].timeout == timeout) {
+			client->timeouts[i].deadline =
+			    now_ms() + dbus_timeout_get_interval(timeout);
+			return;
+		}
+	}
+}
+
+/**
+ * Fires the expired timeouts. Handling a timeout may add or remove others,
+ * so the scan restarts after each one.
+ */
+static void handle_timeouts(dbus_client * client)
+{
+	long long now = now_ms();
+	int i = 0;
+
+	while (i < client->n_timeouts) {
+		struct client_timeout *t = &client->timeouts[i];
+
+		if (!dbus_timeout_get_enabled(t->timeout) || t->deadline > now) {
+			i++;
+			continue;
+		}
+
+		t->deadline = now + dbus_timeout_get_interval(t->timeout) + 1;
+		dbus_timeout_handle(t->timeout);
+		i = 0;
+	}
+}
+
+static DBusHandlerResult filter_message(DBusConnection * connection,
+					DBusMessage * message, void *data)
+{
+	dbus_client *client = data;
+
+	if (client->handler == NULL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	return client->handler(client, message, client->handler_data);
+}
+
+/**
+ * Connects to address, or to the type bus when address is NULL. Each client
+ * has a private connection of its own, so its filter and timeouts don't
+ * affect other clients of the process. Returns NULL and sets error upon
+ * failure.
+ */
+dbus_client *dbus_client_open(const char *address, DBusBusType type,
+			      DBusError * error)
+{
+	dbus_client *client;
+
+	client = calloc(1, sizeof(*client));
+	if (client == NULL) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY,
+				     "Not enough memory");
+		return NULL;
+	}
+
+	if (address != NULL) {
+		client->connection = dbus_connection_open_private(address,
+								  error);
+		if (client->connection &&
+		    !dbus_bus_register(client->connection, error)) {
+			dbus_connection_close(client->connection);
+			dbus_connection_unref(client->connection);
+			client->connection = NULL;
+		}
+	} else
+		client->connection = dbus_bus_get_private(type, error);
+
+	if (client->connection == NULL)
+		goto fail;
+
+	if (!dbus_connection_set_timeout_functions(client->connection,
+						   add_timeout, remove_timeout,
+						   toggle_timeout, client,
+						   NULL) ||
+	    !dbus_connection_add_filter(client->connection, filter_message,
+					client, NULL)) {
+		dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY,
+				     "Not enough memory");
+		dbus_connection_set_timeout_functions(client->connection, NULL,
+						      NULL, NULL, NULL, NULL);
+		dbus_connection_close(client->connection);
+		dbus_connection_unref(client->connection);
+		goto fail;
+	}
+
+	return client;
+
+fail:
+	free(client);
+	return NULL;
+}
+
+void dbus_client_close(dbus_client * client)
+{
+	if (client == NULL)
+		return;
+
+	dbus_connection_remove_filter(client->connection, filter_message,
+				      client);
+	dbus_connection_set_timeout_functions(client->connection, NULL, NULL,
+					      NULL, NULL, NULL);
+	dbus_connection_close(client->connection);
+	dbus_connection_unref(client->connection);
+	free(client->timeouts);
+	free(client);
+}
+
+DBusConnection *dbus_client_connection(dbus_client * client)
+{
+	return client->connection;
+}
+
+void dbus_client_set_handler(dbus_client * client, dbus_client_message_cb cb,
+			     void *user_data)
+{
+	client->handler = cb;
+	client->handler_data = user_data;
+}
+
+static void call_complete(DBusPendingCall * pending, void *data)
+{
+	struct client_call *call = data;
+	DBusMessage *reply;
+
+	call->client->pending--;
+
+	reply = dbus_pending_call_steal_reply(pending);
+	if (call->cb)
+		call->cb(call->client, reply, call->user_data);
+	if (reply)
+		dbus_message_unref(reply);
+	dbus_pending_call_unref(pending);
+}
+
+/**
+ * Queues the method call message and returns without waiting for the reply.
+ * cb is invoked from dbus_client_dispatch() once the reply or error arrives.
+ * timeout_ms of -1 selects the libdbus default. Returns -1 upon error.
+ */
+int dbus_client_call_async(dbus_client * client, DBusMessage * message,
+			   int timeout_ms, dbus_client_reply_cb cb,
+			   void *user_data)
+{
+	DBusPendingCall *pending = NULL;
+	struct client_call *call;
+
+	call = malloc(sizeof(*call));
+	if (call == NULL)
+		return -1;
+	call->client = client;
+	call->cb = cb;
+	call->user_data = user_data;
+
+	if (!dbus_connection_send_with_reply(client->connection, message,
+					     &pending, timeout_ms) ||
+	    pending == NULL) {
+		free(call);
+		return -1;
+	}
+
+	if (!dbus_pending_call_set_notify(pending, call_complete, call, free)) {
+		dbus_pending_call_cancel(pending);
+		dbus_pending_call_unref(pending);
+		free(call);
+		return -1;
+	}
+
+	client->pending++;
+	return 0;
+}
+
+/**
+ * Queues a signal (or any message not expecting a reply). Returns -1 upon
+ * error.
+ */
+int dbus_client_emit(dbus_client * client, DBusMessage * message)
+{
+	return dbus_connection_send(client->connection, message, NULL) ? 0 : -1;
+}
+
+/**
+ * Returns the number of calls still waiting for their reply callback
+ */
+int dbus_client_pending(dbus_client * client)
+{
+	return client->pending;
+}
+
+/**
+ * Blocks until the outgoing queue has been written to the socket
+ */
+void dbus_client_flush(dbus_client * client)
+{
+	dbus_connection_flush(client->connection);
+}
+
+int dbus_client_get_fd(dbus_client * client)
+{
+	int fd = -1;
+
+	if (!dbus_connection_get_socket(client->connection, &fd))
+		return -1;
+	return fd;
+}
+
+short dbus_client_get_events(dbus_client * client)
+{
+	short events = POLLIN;
+
+	if (dbus_connection_has_messages_to_send(client->connection))
+		events |= POLLOUT;
+	return events;
+}
+
+/**
+ * Returns the number of ms until dbus_client_dispatch() has timeouts to
+ * handle, or -1 when there is nothing to wait for.
+ */
+int dbus_client_next_timeout(dbus_client * client)
+{
+	long long now, next = -1;
+	int i;
+
+	if (dbus_connection_get_dispatch_status(client->connection) ==
+	    DBUS_DISPATCH_DATA_REMAINS)
+		return 0;
+
+	now = now_ms();
+	for (i = 0; i < client->n_timeouts; i++) {
+		struct client_timeout *t = &client->timeouts[i];
+		long long left;
+
+		if (!dbus_timeout_get_enabled(t->timeout))
+			continue;
+
+		left = t->deadline > now ? t->deadline - now : 0;
+		if (next < 0 || left < next)
+			next = left;
+	}
+
+	return next;
+}
+
+static int process(dbus_client * client, int timeout_ms)
+{
+	struct timespec ts;
+
+	if (!dbus_connection_read_write(client->connection, timeout_ms))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	client->read_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	handle_timeouts(client);
+
+	while (dbus_connection_dispatch(client->connection) ==
+	       DBUS_DISPATCH_DATA_REMAINS) ;
+
+	return 0;
+}
+
+/**
+ * Returns the CLOCK_MONOTONIC time in ns at which the socket read that
+ * queued the messages being dispatched returned; together with the time a
+ * handler runs, it tells how long a message waited in the incoming queue.
+ */
+long long dbus_client_read_ns(dbus_client * client)
+{
+	return client->read_ns;
+}
+
+/**
+ * Reads and writes whatever the socket allows without blocking, then runs
+ * the reply callbacks and the message handler. Returns -1 when the
+ * connection is closed.
+ */
+int dbus_client_dispatch(dbus_client * client)
+{
+	return process(client, 0);
+}
+
+/**
+ * Like dbus_client_dispatch() but blocks for up to timeout_ms (or until the
+ * next call timeout) waiting for data. A timeout_ms of -1 blocks
+ * indefinitely.
+ */
+int dbus_client_iterate(dbus_client * client, int timeout_ms)
+{
+	int next = dbus_client_next_timeout(client);
+
+	if (next >= 0 && (timeout_ms < 0 || next < timeout_ms))
+		timeout_ms = next;
+
+	return process(client, timeout_ms);
+}
@@ -0,0 +1,78 @@
+/* dbus_client.h
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Connection handle shared by dbus_message, dbus_service and programs that
+ * link libdbus_client.a instead of spawning dbus_message.
+ *
+ * Nothing blocks except dbus_client_iterate(). To drive the client from an
+ * existing event loop, poll dbus_client_get_fd() for
+ * dbus_client_get_events(), with a timeout of dbus_client_next_timeout(),
+ * and call dbus_client_dispatch() whenever poll() returns. Reply callbacks
+ * and the message handler run from within dispatch.
+ */
+
+#ifndef DBUS_CLIENT_H
+#define DBUS_CLIENT_H
+
+#include <dbus/dbus.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct dbus_client dbus_client;
+
+/* reply is the method return or error message; it is only valid during the
+ * callback. A call that times out gets a DBUS_ERROR_NO_REPLY error reply.
+ */
+typedef void (*dbus_client_reply_cb)(dbus_client * client,
+				     DBusMessage * reply, void *user_data);
+
+/* Called for every incoming message that isn't a reply to call_async() */
+typedef DBusHandlerResult(*dbus_client_message_cb) (dbus_client * client,
+						     DBusMessage * message,
+						     void *user_data);
+
+dbus_client *dbus_client_open(const char *address, DBusBusType type,
+			      DBusError * error);
+void dbus_client_close(dbus_client * client);
+DBusConnection *dbus_client_connection(dbus_client * client);
+
+void dbus_client_set_handler(dbus_client * client, dbus_client_message_cb cb,
+			     void *user_data);
+int dbus_client_call_async(dbus_client * client, DBusMessage * message,
+			   int timeout_ms, dbus_client_reply_cb cb,
+			   void *user_data);
+int dbus_client_emit(dbus_client * client, DBusMessage * message);
+int dbus_client_pending(dbus_client * client);
+void dbus_client_flush(dbus_client * client);
+
+int dbus_client_get_fd(dbus_client * client);
+short dbus_client_get_events(dbus_client * client);
+int dbus_client_next_timeout(dbus_client * client);
+int dbus_client_dispatch(dbus_client * client);
+long long dbus_client_read_ns(dbus_client * client);
+int dbus_client_iterate(dbus_client * client, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DBUS_CLIENT_H */
@@ -23,13 +23,60 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "dbus_common.h"
 
+long long monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Parses a number of bytes with an optional K, M or G suffix. Returns -1
+ * when value isn't one.
+ */
+long long parse_size(const char *value)
+{
+	long long size;
+	int shift = 0;
+	char *end;
+
+	errno = 0;
+	size = strtoll(value, &end, 10);
+	if (errno || end == value || size < 0)
+		return -1;
+
+	switch (*end) {
+	case 'K':
+		shift = 10;
+		end++;
+		break;
+	case 'M':
+		shift = 20;
+		end++;
+		break;
+	case 'G':
+		shift = 30;
+		end++;
+		break;
+	}
+
+	if (*end != '\0' || size > LLONG_MAX >> shift)
+		return -1;
+
+	return size << shift;
+}
+
 const char *type_to_name(int message_type)
 {
 	switch (message_type) {
@@ -94,7 +141,10 @@ void log_message(int log_fd, const char *prefix, DBusMessage * message)
 	}
 }
 
-void append_arg(DBusMessageIter * iter, int type, const char *value)
+/**
+ * Appends value, parsed as type, to iter. Returns 0 on success, 1 upon error.
+ */
+int append_arg(DBusMessageIter * iter, int type, const char *value)
 {
 	dbus_uint16_t uint16;
 	dbus_int16_t int16;
@@ -170,57 +220,79 @@ void append_arg(DBusMessageIter * iter, int type, const char *value)
 			fprintf(stderr,
 				"FAIL: Expected \"true\" or \"false\" instead of \"%s\"\n",
 				value);
-			exit(1);
+			return 1;
 		}
 		break;
 
 	default:
 		fprintf(stderr, "FAIL: Unsupported data type %c\n", (char)type);
-		exit(1);
+		return 1;
 	}
+
+	return 0;
 }
 
-void append_array(DBusMessageIter * iter, int type, const char *value)
+/**
+ * Appends the comma separated values, parsed as type, to iter. Returns 0 on
+ * success, 1 upon error.
+ */
+int append_array(DBusMessageIter * iter, int type, const char *value)
 {
 	const char *val;
 	char *dupval = strdup(value);
+	int rc = 0;
 
 	val = strtok(dupval, ",");
-	while (val != NULL) {
-		append_arg(iter, type, val);
+	while (val != NULL && rc == 0) {
+		rc = append_arg(iter, type, val);
 		val = strtok(NULL, ",");
 	}
 	free(dupval);
+	return rc;
 }
 
-void
+/**
+ * Appends the comma separated key,value pairs to iter. Returns 0 on success,
+ * 1 upon error.
+ */
+int
 append_dict(DBusMessageIter * iter, int keytype, int valtype, const char *value)
 {
 	const char *val;
 	char *dupval = strdup(value);
+	int rc = 0;
 
 	val = strtok(dupval, ",");
-	while (val != NULL) {
+	while (val != NULL && rc == 0) {
 		DBusMessageIter subiter;
 
 		dbus_message_iter_open_container(iter,
 						 DBUS_TYPE_DICT_ENTRY,
 						 NULL, &subiter);
 
-		append_arg(&subiter, keytype, val);
+		rc = append_arg(&subiter, keytype, val);
 		val = strtok(NULL, ",");
-		if (val == NULL) {
+		if (rc == 0 && val == NULL) {
 			fprintf(stderr, "FAIL: Malformed dictionary\n");
-			exit(1);
+			rc = 1;
 		}
-		append_arg(&subiter, valtype, val);
+		if (rc == 0)
+			rc = append_arg(&subiter, valtype, val);
 
-		dbus_message_iter_close_container(iter, &subiter);
+		if (rc == 0)
+			dbus_message_iter_close_container(iter, &subiter);
+		else
+			dbus_message_iter_abandon_container(iter, &subiter);
 		val = strtok(NULL, ",");
 	}
 	free(dupval);
+	return rc;
 }
 
+/**
+ * Returns the D-Bus type called arg on the command line, or
+ * DBUS_TYPE_INVALID when there is none.
+ */
 int type_from_name(const char *arg)
 {
 	int type;
@@ -248,7 +320,418 @@ int type_from_name(const char *arg)
 		type = DBUS_TYPE_OBJECT_PATH;
 	else {
 		fprintf(stderr, "FAIL: Unknown type \"%s\"\n", arg);
-		exit(1);
+		type = DBUS_TYPE_INVALID;
 	}
 	return type;
 }
+
+/**
+ * Appends the "[container:]type:value" command line arguments to iter.
+ * The arguments are modified in place. Returns 0 on success, 1 upon error.
+ */
+int append_args(DBusMessageIter * iter, int argc, char *argv[])
+{
+	int i = 0;
+	int rc;
+
+	while (i < argc) {
+		char *arg;
+		char *c;
+		int type;
+		int secondary_type;
+		int container_type;
+		DBusMessageIter *target_iter;
+		DBusMessageIter container_iter;
+
+		type = DBUS_TYPE_INVALID;
+		arg = argv[i++];
+		c = strchr(arg, ':');
+
+		if (c == NULL) {
+			fprintf(stderr,
+				"FAIL: %s: Data item \"%s\" is badly formed\n",
+				argv[0], arg);
+			return 1;
+		}
+
+		*(c++) = 0;
+
+		container_type = DBUS_TYPE_INVALID;
+
+		if (strcmp(arg, "variant") == 0)
+			container_type = DBUS_TYPE_VARIANT;
+		else if (strcmp(arg, "array") == 0)
+			container_type = DBUS_TYPE_ARRAY;
+		else if (strcmp(arg, "dict") == 0)
+			container_type = DBUS_TYPE_DICT_ENTRY;
+
+		if (container_type != DBUS_TYPE_INVALID) {
+			arg = c;
+			c = strchr(arg, ':');
+			if (c == NULL) {
+				fprintf(stderr,
+					"FAIL: %s: Data item \"%s\" is badly formed\n",
+					argv[0], arg);
+				return 1;
+			}
+			*(c++) = 0;
+		}
+
+		if (arg[0] == 0)
+			type = DBUS_TYPE_STRING;
+		else if ((type = type_from_name(arg)) == DBUS_TYPE_INVALID)
+			return 1;
+
+		if (container_type == DBUS_TYPE_DICT_ENTRY) {
+			char sig[5];
+			arg = c;
+			c = strchr(c, ':');
+			if (c == NULL) {
+				fprintf(stderr,
+					"FAIL: %s: Data item \"%s\" is badly formed\n",
+					argv[0], arg);
+				return 1;
+			}
+			*(c++) = 0;
+			secondary_type = type_from_name(arg);
+			if (secondary_type == DBUS_TYPE_INVALID)
+				return 1;
+			sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
+			sig[1] = type;
+			sig[2] = secondary_type;
+			sig[3] = DBUS_DICT_ENTRY_END_CHAR;
+			sig[4] = '\0';
+			dbus_message_iter_open_container(iter,
+							 DBUS_TYPE_ARRAY,
+							 sig, &container_iter);
+			target_iter = &container_iter;
+		} else if (container_type != DBUS_TYPE_INVALID) {
+			char sig[2];
+			sig[0] = type;
+			sig[1] = '\0';
+			dbus_message_iter_open_container(iter,
+							 container_type,
+							 sig, &container_iter);
+			target_iter = &container_iter;
+		} else
+			target_iter = iter;
+
+		if (container_type == DBUS_TYPE_ARRAY) {
+			rc = append_array(target_iter, type, c);
+		} else if (container_type == DBUS_TYPE_DICT_ENTRY) {
+			rc = append_dict(target_iter, type, secondary_type, c);
+		} else
+			rc = append_arg(target_iter, type, c);
+
+		if (container_type != DBUS_TYPE_INVALID) {
+			if (rc)
+				dbus_message_iter_abandon_container(iter,
+								    &container_iter);
+			else
+				dbus_message_iter_close_container(iter,
+								  &container_iter);
+		}
+		if (rc)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Unix fds can't be copied like other values: every read dups them */
+static int has_unix_fds(const char *signature)
+{
+	return strchr(signature, DBUS_TYPE_UNIX_FD) != NULL;
+}
+
+static int copy_value(DBusMessageIter * from, DBusMessageIter * to, int type)
+{
+	DBusMessageIter from_sub, to_sub;
+	char *signature = NULL;
+	const char *contained = NULL;
+	int rc;
+
+	if (dbus_type_is_basic(type)) {
+		DBusBasicValue value;
+
+		dbus_message_iter_get_basic(from, &value);
+		return dbus_message_iter_append_basic(to, type, &value) ? 0 : -1;
+	}
+
+	dbus_message_iter_recurse(from, &from_sub);
+
+	if (type == DBUS_TYPE_ARRAY) {
+		int element = dbus_message_iter_get_element_type(from);
+
+		if (dbus_type_is_fixed(element) &&
+		    element != DBUS_TYPE_UNIX_FD) {
+			char element_signature[2] = { element, '\0' };
+			const void *data;
+			int n;
+
+			dbus_message_iter_get_fixed_array(&from_sub, &data, &n);
+			if (!dbus_message_iter_open_container(to, type,
+							      element_signature,
+							      &to_sub))
+				return -1;
+			if (!dbus_message_iter_append_fixed_array(&to_sub,
+								  element,
+								  &data, n)) {
+				dbus_message_iter_abandon_container(to, &to_sub);
+				return -1;
+			}
+			return dbus_message_iter_close_container(to, &to_sub) ?
+			    0 : -1;
+		}
+
+		/* the signature of the whole array, skip the 'a' */
+		signature = dbus_message_iter_get_signature(from);
+		contained = signature ? signature + 1 : NULL;
+	} else if (type == DBUS_TYPE_VARIANT) {
+		signature = dbus_message_iter_get_signature(&from_sub);
+		contained = signature;
+	}
+
+	if ((type == DBUS_TYPE_ARRAY || type == DBUS_TYPE_VARIANT) &&
+	    contained == NULL)
+		return -1;
+
+	if (!dbus_message_iter_open_container(to, type, contained, &to_sub)) {
+		dbus_free(signature);
+		return -1;
+	}
+	dbus_free(signature);
+
+	rc = copy_args(&from_sub, &to_sub);
+	if (rc < 0)
+		dbus_message_iter_abandon_container(to, &to_sub);
+	else if (!dbus_message_iter_close_container(to, &to_sub))
+		rc = -1;
+
+	return rc;
+}
+
+/**
+ * Appends the values from the position of from onwards to to. Returns -1
+ * when out of memory.
+ */
+int copy_args(DBusMessageIter * from, DBusMessageIter * to)
+{
+	int type;
+
+	while ((type = dbus_message_iter_get_arg_type(from)) !=
+	       DBUS_TYPE_INVALID) {
+		if (copy_value(from, to, type) < 0)
+			return -1;
+		dbus_message_iter_next(from);
+	}
+
+	return 0;
+}
+
+static int is_single_complete_type(const char *signature)
+{
+	DBusSignatureIter sig;
+
+	dbus_signature_iter_init(&sig, signature);
+	return !dbus_signature_iter_next(&sig);
+}
+
+/**
+ * Appends the signature and the variant holding the arguments of message,
+ * as found in Batch requests and results. Returns -1 when out of memory or
+ * when the arguments hold unix fds, which a Batch doesn't carry.
+ */
+int pack_args(DBusMessage * message, DBusMessageIter * iter)
+{
+	const char *signature = dbus_message_get_signature(message);
+	DBusMessageIter args, variant, fields;
+	char *contained;
+	int single, rc;
+
+	if (has_unix_fds(signature) ||
+	    !dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &signature))
+		return -1;
+
+	if (signature[0] == '\0') {
+		const char *empty = "";
+
+		if (!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT,
+						      DBUS_TYPE_STRING_AS_STRING,
+						      &variant))
+			return -1;
+		if (!dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING,
+						    &empty)) {
+			dbus_message_iter_abandon_container(iter, &variant);
+			return -1;
+		}
+		return dbus_message_iter_close_container(iter, &variant) ?
+		    0 : -1;
+	}
+
+	single = is_single_complete_type(signature);
+	if (single)
+		contained = strdup(signature);
+	else if (asprintf(&contained, "(%s)", signature) < 0)
+		contained = NULL;
+	if (contained == NULL)
+		return -1;
+
+	if (!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT,
+					      contained, &variant)) {
+		free(contained);
+		return -1;
+	}
+	free(contained);
+
+	dbus_message_iter_init(message, &args);
+	if (single)
+		rc = copy_args(&args, &variant);
+	else if (!dbus_message_iter_open_container(&variant, DBUS_TYPE_STRUCT,
+						   NULL, &fields))
+		rc = -1;
+	else {
+		rc = copy_args(&args, &fields);
+		if (rc < 0)
+			dbus_message_iter_abandon_container(&variant, &fields);
+		else if (!dbus_message_iter_close_container(&variant, &fields))
+			rc = -1;
+	}
+
+	if (rc < 0)
+		dbus_message_iter_abandon_container(iter, &variant);
+	else if (!dbus_message_iter_close_container(iter, &variant))
+		rc = -1;
+
+	return rc;
+}
+
+/**
+ * Reads a signature and variant written by pack_args() at iter and appends
+ * the values to message. Returns -1 when they don't match, hold unix fds or
+ * when out of memory.
+ */
+int unpack_args(DBusMessageIter * iter, DBusMessage * message)
+{
+	DBusMessageIter variant, fields, args;
+	const char *signature;
+	char *actual;
+	size_t len;
+	int match;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING)
+		return -1;
+	dbus_message_iter_get_basic(iter, &signature);
+	if (!dbus_signature_validate(signature, NULL) ||
+	    has_unix_fds(signature) ||
+	    !dbus_message_iter_next(iter) ||
+	    dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT)
+		return -1;
+
+	if (signature[0] == '\0')
+		return 0;
+
+	dbus_message_iter_recurse(iter, &variant);
+	actual = dbus_message_iter_get_signature(&variant);
+	if (actual == NULL)
+		return -1;
+
+	len = strlen(signature);
+	if (is_single_complete_type(signature))
+		match = strcmp(actual, signature) == 0;
+	else
+		match = actual[0] == DBUS_STRUCT_BEGIN_CHAR &&
+		    strncmp(actual + 1, signature, len) == 0 &&
+		    actual[len + 1] == DBUS_STRUCT_END_CHAR &&
+		    actual[len + 2] == '\0';
+	dbus_free(actual);
+	if (!match)
+		return -1;
+
+	dbus_message_iter_init_append(message, &args);
+	if (is_single_complete_type(signature))
+		return copy_args(&variant, &args);
+
+	dbus_message_iter_recurse(&variant, &fields);
+	return copy_args(&fields, &args);
+}
+
+static long fixed_size(int type)
+{
+	switch (type) {
+	case DBUS_TYPE_BYTE:
+		return 1;
+	case DBUS_TYPE_INT16:
+	case DBUS_TYPE_UINT16:
+		return 2;
+	case DBUS_TYPE_INT64:
+	case DBUS_TYPE_UINT64:
+	case DBUS_TYPE_DOUBLE:
+		return 8;
+	default:
+		return 4;
+	}
+}
+
+static long values_size(DBusMessageIter * iter)
+{
+	long size = 0;
+	int type;
+
+	while ((type = dbus_message_iter_get_arg_type(iter)) !=
+	       DBUS_TYPE_INVALID) {
+		DBusMessageIter sub;
+
+		/* the largest padding of any value */
+		size += 7;
+
+		if (type == DBUS_TYPE_ARRAY) {
+			int element = dbus_message_iter_get_element_type(iter);
+
+			dbus_message_iter_recurse(iter, &sub);
+			size += 4 + 7;
+			if (dbus_type_is_fixed(element) &&
+			    element != DBUS_TYPE_UNIX_FD) {
+				const void *data;
+				int n;
+
+				dbus_message_iter_get_fixed_array(&sub, &data, &n);
+				size += n * fixed_size(element);
+			} else
+				size += values_size(&sub);
+		} else if (type == DBUS_TYPE_VARIANT) {
+			/* the signature is at most 255 bytes */
+			dbus_message_iter_recurse(iter, &sub);
+			size += 1 + DBUS_MAXIMUM_SIGNATURE_LENGTH + 1 +
+			    values_size(&sub);
+		} else if (dbus_type_is_container(type)) {
+			dbus_message_iter_recurse(iter, &sub);
+			size += values_size(&sub);
+		} else if (type == DBUS_TYPE_STRING ||
+			   type == DBUS_TYPE_OBJECT_PATH ||
+			   type == DBUS_TYPE_SIGNATURE) {
+			const char *value;
+
+			dbus_message_iter_get_basic(iter, &value);
+			size += 4 + strlen(value) + 1;
+		} else
+			size += fixed_size(type);
+
+		dbus_message_iter_next(iter);
+	}
+
+	return size;
+}
+
+/**
+ * Returns an upper bound of the size of the body of message once
+ * marshalled, without marshalling it
+ */
+long args_size(DBusMessage * message)
+{
+	DBusMessageIter args;
+
+	if (!dbus_message_iter_init(message, &args))
+		return 0;
+	return values_size(&args);
+}
@@ -18,12 +18,44 @@
  *
  */
 
+#ifndef DBUS_COMMON_H
+#define DBUS_COMMON_H
+
 #include <dbus/dbus.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 const char *type_to_name(int message_type);
 void log_message(int log_fd, const char *prefix, DBusMessage * message);
-void append_arg(DBusMessageIter * iter, int type, const char *value);
-void append_array(DBusMessageIter * iter, int type, const char *value);
-void append_dict(DBusMessageIter * iter, int keytype, int valtype,
-		 const char *value);
+int append_arg(DBusMessageIter * iter, int type, const char *value);
+int append_array(DBusMessageIter * iter, int type, const char *value);
+int append_dict(DBusMessageIter * iter, int keytype, int valtype,
+		const char *value);
 int type_from_name(const char *arg);
+int append_args(DBusMessageIter * iter, int argc, char *argv[]);
+long long monotonic_ns(void);
+long long parse_size(const char *value);
+
+/* Batch(a(ssv) requests) -> (a(ssv) results)
+ *
+ * Each request is (member, signature, values) and each result is
+ * (error name or "" on success, signature, values), in the same order. The
+ * values of a signature with several complete types are wrapped in a
+ * struct; with no type at all, the variant holds an ignored "".
+ */
+#define BATCH_MEMBER "Batch"
+#define BATCH_SIGNATURE "a(ssv)"
+#define BATCH_ENTRY_SIGNATURE "(ssv)"
+
+int copy_args(DBusMessageIter * from, DBusMessageIter * to);
+int pack_args(DBusMessage * message, DBusMessageIter * iter);
+int unpack_args(DBusMessageIter * iter, DBusMessage * message);
+long args_size(DBusMessage * message);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DBUS_COMMON_H */
@@ -0,0 +1,446 @@
+/* dbus_common_bench.c  Microbenchmarks of the dbus_common primitives
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Every message is built in memory; no bus connection is made.
+ *
+ * ns/op is the time of one call of the primitive (for containers, one whole
+ * container of size elements) and bytes/op the wire size it produces, i.e.
+ * how much the marshalled message grows. With --marshal, the append
+ * benchmarks also serialize the message with dbus_message_marshal(). The
+ * demarshal benchmark parses such a message back with
+ * dbus_message_demarshal() and reads every element.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dbus_common.h"
+
+#define BENCH_PATH "/com/canonical/HelloDbusFramework/DbusSrv"
+#define BENCH_INTERFACE "com.canonical.HelloDbusFramework.DbusSrv"
+
+struct bench_type {
+	const char *name;
+	const char *value;
+};
+
+static const struct bench_type types[] = {
+	{"byte", "7"},
+	{"boolean", "true"},
+	{"int16", "-1234"},
+	{"uint16", "1234"},
+	{"int32", "-123456"},
+	{"uint32", "123456"},
+	{"int64", "-1234567890123"},
+	{"uint64", "1234567890123"},
+	{"double", "3.25"},
+	{"string", "hello"},
+	{"objpath", "/com/canonical/Object"},
+};
+
+#define N_TYPES (sizeof(types) / sizeof(types[0]))
+
+static long long min_time_ns = 100000000LL;
+static long max_size = 1000000;
+static int do_marshal = 0;
+static int null_fd = -1;
+static int empty_size;		/* wire size of a message without arguments */
+
+/* The benchmarked operation, with everything it needs */
+struct bench_args {
+	int type;
+	int valtype;
+	const char *value;	/* one value, or comma separated list */
+	const char *name;
+	DBusMessage *message;	/* for log_message */
+	char *wire;		/* for demarshal */
+	int wire_len;
+};
+
+typedef void (*bench_fn) (struct bench_args * args);
+
+static DBusMessage *new_message(void)
+{
+	DBusMessage *message;
+
+	message = dbus_message_new_signal(BENCH_PATH, BENCH_INTERFACE, "Signal");
+	if (message == NULL) {
+		fprintf(stderr, "FAIL: Couldn't allocate D-Bus message\n");
+		exit(1);
+	}
+	/* dbus_message_demarshal() rejects messages that were never sent */
+	dbus_message_set_serial(message, 1);
+	return message;
+}
+
+static int marshalled_size(DBusMessage * message)
+{
+	char *data;
+	int len;
+
+	if (!dbus_message_marshal(message, &data, &len)) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		exit(1);
+	}
+	dbus_free(data);
+	return len;
+}
+
+static void maybe_marshal(DBusMessage * message)
+{
+	if (do_marshal)
+		marshalled_size(message);
+}
+
+/**
+ * Runs fn in growing batches until one batch lasts at least min_time_ns,
+ * and returns the time per call of that batch
+ */
+static double time_ns_per_op(bench_fn fn, struct bench_args *args)
+{
+	long iterations = 1;
+
+	fn(args);		/* warm up */
+
+	for (;;) {
+		long long start = monotonic_ns(), elapsed;
+		long i;
+
+		for (i = 0; i < iterations; i++)
+			fn(args);
+		elapsed = monotonic_ns() - start;
+
+		if (elapsed >= min_time_ns)
+			return (double)elapsed / iterations;
+
+		/* aim a bit past min_time_ns, growing at least twofold */
+		if (elapsed < min_time_ns / 2)
+			iterations = min_time_ns * 11 / 10 /
+			    (elapsed > 0 ? elapsed : 1) * iterations;
+		else
+			iterations *= 2;
+	}
+}
+
+static void report(const char *bench, const char *type, long size,
+		   double ns, double bytes)
+{
+	printf("%-14s %-14s %8ld %14.1f %10.2f %12.1f\n", bench, type, size, ns,
+	       ns / size, bytes);
+	fflush(stdout);
+}
+
+static void bench_type_from_name(struct bench_args *args)
+{
+	type_from_name(args->name);
+}
+
+/* Appends 64 args to amortize the message allocation */
+#define ARGS_PER_MESSAGE 64
+
+static void bench_append_arg(struct bench_args *args)
+{
+	DBusMessage *message = new_message();
+	DBusMessageIter iter;
+	int i;
+
+	dbus_message_iter_init_append(message, &iter);
+	for (i = 0; i < ARGS_PER_MESSAGE; i++)
+		append_arg(&iter, args->type, args->value);
+	maybe_marshal(message);
+	dbus_message_unref(message);
+}
+
+static void build_array(DBusMessage * message, struct bench_args *args)
+{
+	DBusMessageIter iter, sub;
+	char sig[2] = { (char)args->type, '\0' };
+
+	dbus_message_iter_init_append(message, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, sig, &sub);
+	append_array(&sub, args->type, args->value);
+	dbus_message_iter_close_container(&iter, &sub);
+}
+
+static void bench_append_array(struct bench_args *args)
+{
+	DBusMessage *message = new_message();
+
+	build_array(message, args);
+	maybe_marshal(message);
+	dbus_message_unref(message);
+}
+
+static void build_dict(DBusMessage * message, struct bench_args *args)
+{
+	DBusMessageIter iter, sub;
+	char sig[5] = { DBUS_DICT_ENTRY_BEGIN_CHAR, (char)args->type,
+		(char)args->valtype, DBUS_DICT_ENTRY_END_CHAR, '\0'
+	};
+
+	dbus_message_iter_init_append(message, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, sig, &sub);
+	append_dict(&sub, args->type, args->valtype, args->value);
+	dbus_message_iter_close_container(&iter, &sub);
+}
+
+static void bench_append_dict(struct bench_args *args)
+{
+	DBusMessage *message = new_message();
+
+	build_dict(message, args);
+	maybe_marshal(message);
+	dbus_message_unref(message);
+}
+
+static void bench_log_message(struct bench_args *args)
+{
+	log_message(null_fd, "received ", args->message);
+}
+
+/**
+ * Reads back every basic value, recursing into containers, the way a
+ * receiver would
+ */
+static long read_values(DBusMessageIter * iter)
+{
+	long n = 0;
+
+	do {
+		int type = dbus_message_iter_get_arg_type(iter);
+
+		if (type == DBUS_TYPE_INVALID)
+			break;
+
+		if (type == DBUS_TYPE_ARRAY &&
+		    dbus_type_is_fixed(dbus_message_iter_get_element_type(iter))) {
+			DBusMessageIter sub;
+			const void *values;
+			int len;
+
+			dbus_message_iter_recurse(iter, &sub);
+			dbus_message_iter_get_fixed_array(&sub, &values, &len);
+			n += len;
+		} else if (dbus_type_is_container(type)) {
+			DBusMessageIter sub;
+
+			dbus_message_iter_recurse(iter, &sub);
+			n += read_values(&sub);
+		} else {
+			DBusBasicValue value;
+
+			dbus_message_iter_get_basic(iter, &value);
+			n++;
+		}
+	} while (dbus_message_iter_next(iter));
+
+	return n;
+}
+
+static void bench_demarshal(struct bench_args *args)
+{
+	DBusMessage *message;
+	DBusMessageIter iter;
+	DBusError error;
+
+	dbus_error_init(&error);
+	message = dbus_message_demarshal(args->wire, args->wire_len, &error);
+	if (message == NULL) {
+		fprintf(stderr, "FAIL: %s: %s\n", error.name, error.message);
+		exit(1);
+	}
+	if (dbus_message_iter_init(message, &iter))
+		read_values(&iter);
+	dbus_message_unref(message);
+}
+
+/**
+ * Returns "value,value,..." with n values, or "key,value,..." with n pairs
+ * when val is set
+ */
+static char *repeat_value(const char *key, const char *val, long n)
+{
+	size_t klen = strlen(key), vlen = val ? strlen(val) + 1 : 0;
+	char *s, *p;
+	long i;
+
+	s = malloc(n * (klen + vlen + 1) + 1);
+	if (s == NULL) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		exit(1);
+	}
+
+	for (i = 0, p = s; i < n; i++) {
+		memcpy(p, key, klen);
+		p += klen;
+		if (val) {
+			*p++ = ',';
+			memcpy(p, val, vlen - 1);
+			p += vlen - 1;
+		}
+		*p++ = ',';
+	}
+	p[-1] = '\0';
+
+	return s;
+}
+
+static void run_containers(const struct bench_type *t, long size)
+{
+	struct bench_args args;
+	DBusMessage *message;
+	char name[64];
+
+	memset(&args, 0, sizeof(args));
+	args.type = type_from_name(t->name);
+
+	/* array:<type> */
+	args.value = repeat_value(t->value, NULL, size);
+	message = new_message();
+	build_array(message, &args);
+	dbus_message_marshal(message, &args.wire, &args.wire_len);
+	dbus_message_unref(message);
+
+	report("append_array", t->name, size,
+	       time_ns_per_op(bench_append_array, &args),
+	       args.wire_len - empty_size);
+	report("demarshal", t->name, size,
+	       time_ns_per_op(bench_demarshal, &args),
+	       args.wire_len - empty_size);
+	dbus_free(args.wire);
+	free((char *)args.value);
+
+	/* dict:<type>:int32 */
+	args.valtype = DBUS_TYPE_INT32;
+	args.value = repeat_value(t->value, "1", size);
+	message = new_message();
+	build_dict(message, &args);
+	dbus_message_marshal(message, &args.wire, &args.wire_len);
+	dbus_message_unref(message);
+
+	snprintf(name, sizeof(name), "{%s,int32}", t->name);
+	report("append_dict", name, size,
+	       time_ns_per_op(bench_append_dict, &args),
+	       args.wire_len - empty_size);
+	report("demarshal", name, size,
+	       time_ns_per_op(bench_demarshal, &args),
+	       args.wire_len - empty_size);
+	dbus_free(args.wire);
+	free((char *)args.value);
+}
+
+static void usage(int ecode)
+{
+	fprintf(stderr,
+		"Usage: dbus_common_bench [--marshal] [--max-size=N] [--min-time=MS]\n"
+		"    --marshal\t\talso serialize each message in the append benchmarks\n"
+		"    N\t\t\tlargest container size (default 1000000)\n"
+		"    MS\t\t\tminimum duration of each measurement (default 100)\n");
+	exit(ecode);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_args args;
+	DBusMessage *message;
+	unsigned int t;
+	long size;
+	int i;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--marshal") == 0)
+			do_marshal = 1;
+		else if (strstr(argv[i], "--max-size=") == argv[i])
+			max_size = atol(strchr(argv[i], '=') + 1);
+		else if (strstr(argv[i], "--min-time=") == argv[i])
+			min_time_ns = atol(strchr(argv[i], '=') + 1) * 1000000LL;
+		else if (strcmp(argv[i], "--help") == 0)
+			usage(0);
+		else
+			usage(1);
+	}
+
+	null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd < 0) {
+		fprintf(stderr, "FAIL: Couldn't open /dev/null: %m\n");
+		exit(1);
+	}
+
+	message = new_message();
+	empty_size = marshalled_size(message);
+	dbus_message_unref(message);
+
+	printf("%-14s %-14s %8s %14s %10s %12s\n", "benchmark", "type", "size",
+	       "ns/op", "ns/elem", "bytes/op");
+
+	memset(&args, 0, sizeof(args));
+	for (t = 0; t < N_TYPES; t++) {
+		args.name = types[t].name;
+		report("type_from_name", types[t].name, 1,
+		       time_ns_per_op(bench_type_from_name, &args), 0);
+	}
+
+	for (t = 0; t < N_TYPES; t++) {
+		DBusMessageIter iter;
+
+		args.type = type_from_name(types[t].name);
+		args.value = types[t].value;
+
+		message = new_message();
+		dbus_message_iter_init_append(message, &iter);
+		if (append_arg(&iter, args.type, args.value))
+			exit(1);
+		report("append_arg", types[t].name, 1,
+		       time_ns_per_op(bench_append_arg, &args) /
+		       ARGS_PER_MESSAGE, marshalled_size(message) - empty_size);
+		dbus_message_unref(message);
+	}
+
+	for (t = 0; t < N_TYPES; t++) {
+		for (size = 1; size <= max_size; size *= 10)
+			run_containers(&types[t], size);
+	}
+
+	args.message = new_message();
+	report("log_message", "signal", 1,
+	       time_ns_per_op(bench_log_message, &args), 0);
+	dbus_message_unref(args.message);
+
+	args.message = dbus_message_new_method_call(BENCH_INTERFACE, BENCH_PATH,
+						    BENCH_INTERFACE, "Method");
+	dbus_message_set_sender(args.message, ":1.42");
+	dbus_message_set_serial(args.message, 1);
+	report("log_message", "method call", 1,
+	       time_ns_per_op(bench_log_message, &args), 0);
+	message = dbus_message_new_error(args.message,
+					 DBUS_ERROR_UNKNOWN_METHOD, NULL);
+	dbus_message_unref(args.message);
+	args.message = message;
+	report("log_message", "error", 1,
+	       time_ns_per_op(bench_log_message, &args), 0);
+	dbus_message_unref(args.message);
+
+	close(null_fd);
+	return 0;
+}
@@ -32,10 +32,12 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "dbus_client.h"
 #include "dbus_common.h"
+#include "dbus_stream.h"
+#include "dbus_trace.h"
 
-DBusConnection *connection;
-DBusError error;
+dbus_client *client;
 DBusBusType type = DBUS_BUS_SESSION;
 const char *type_str = NULL;
 const char *name = NULL;
@@ -46,28 +48,470 @@ int message_type = DBUS_MESSAGE_TYPE_SIGNAL;
 const char *address = NULL;
 int session_or_system = FALSE;
 int log_fd = -1;
+long count = 1;
+long window = 1;
+long batch = 0;
+const char *stats_path = NULL;
+unsigned long long stream_size = 0;
+long chunk_size = STREAM_DEFAULT_CHUNK;
+const char *trace_path = NULL;
+int trace_sample = TRACE_DEFAULT_SAMPLE;
+trace_file *trace = NULL;
+const char *unique_name = NULL;
 
 static void usage(int ecode)
 {
 	char *prefix = ecode ? "FAIL: " : "";
 
 	fprintf(stderr,
-		"%6sUsage: dbus_message [ADDRESS] [--name=NAME] [--type=TYPE] <path> <interface.member> [contents ...]\n"
+		"%6sUsage: dbus_message [ADDRESS] [--name=NAME] [--type=TYPE] [REPEAT | STREAM] [TRACE] <path> <interface.member> [contents ...]\n"
 		"    ADDRESS\t\t--system, --session (default), or --address=ADDR\n"
 		"    NAME\t\tthe message destination\n"
 		"    TYPE\t\tsignal (default) or method_call\n"
+		"    REPEAT\t\t--count=N to send the message N times, --window=W to keep\n"
+		"          \t\tup to W method calls in flight (default 1) and\n"
+		"          \t\t--stats=FILE to write each round trip time in ns;\n"
+		"          \t\t--batch=B packs every B method calls into one Batch\n"
+		"          \t\tcall, N must then be a multiple of B\n"
+		"    STREAM\t\t--stream=SIZE to move SIZE bytes (K, M or G suffix) through\n"
+		"          \t\tthe Upload or Download member in --chunk=BYTES chunks\n"
+		"          \t\t(default %d), keeping up to W of them in flight\n"
+		"    TRACE\t\t--trace=FILE to record the timing of one in\n"
+		"         \t\t--trace-sample=N calls (default %d), for dbus_trace_merge.py\n"
 		"    path\t\tpath to object (such as /org/freedesktop/DBus)\n"
 		"    interface\t\tinterface to use (such as org.freedesktop.DBus)\n"
 		"    member\t\tname of the method or signal (such as ListNames)\n",
-		prefix);
+		prefix, STREAM_DEFAULT_CHUNK, TRACE_DEFAULT_SAMPLE);
 	exit(ecode);
 }
 
+/* Beyond this much unsent data, wait for the socket instead of queueing */
+#define MAX_OUTGOING_SIZE (1024 * 1024)
+
+/* State of a --count run; a single message is a run with count 1 */
+static long completed = 0;
+static long long *send_ns = NULL;
+static int failed = 0;
+
+/**
+ * Reports the first failed call in the results of a Batch call
+ */
+static int batch_failed(DBusMessage * reply)
+{
+	DBusMessageIter args, results, result, variant;
+	const char *error_name, *signature, *text = NULL;
+
+	if (!dbus_message_has_signature(reply, BATCH_SIGNATURE)) {
+		fprintf(stderr, "FAIL: Malformed %s reply\n", BATCH_MEMBER);
+		return 1;
+	}
+
+	dbus_message_iter_init(reply, &args);
+	dbus_message_iter_recurse(&args, &results);
+	while (dbus_message_iter_get_arg_type(&results) == DBUS_TYPE_STRUCT) {
+		dbus_message_iter_recurse(&results, &result);
+		dbus_message_iter_get_basic(&result, &error_name);
+		if (error_name[0] != '\0') {
+			dbus_message_iter_next(&result);
+			dbus_message_iter_get_basic(&result, &signature);
+			dbus_message_iter_next(&result);
+			dbus_message_iter_recurse(&result, &variant);
+			if (strcmp(signature, DBUS_TYPE_STRING_AS_STRING) == 0)
+				dbus_message_iter_get_basic(&variant, &text);
+			fprintf(stderr, "FAIL: %s: %s\n", error_name,
+				text ? text : "");
+			return 1;
+		}
+		dbus_message_iter_next(&results);
+	}
+
+	return 0;
+}
+
+static void method_reply(dbus_client * client, DBusMessage * reply,
+			 void *user_data)
+{
+	long index = (long)user_data;
+	dbus_uint32_t serial = dbus_message_get_reply_serial(reply);
+	long long now = monotonic_ns();
+	DBusError error;
+
+	send_ns[index] = now - send_ns[index];
+	completed++;
+
+	if (trace_sampled(trace, serial)) {
+		trace_event(trace, TRACE_CLIENT_READ, unique_name, serial,
+			    dbus_client_read_ns(client));
+		trace_event(trace, TRACE_CLIENT_RECEIVE, unique_name, serial,
+			    now);
+	}
+
+	dbus_error_init(&error);
+	if (dbus_set_error_from_message(&error, reply)) {
+		if (!failed)
+			fprintf(stderr, "FAIL: %s: %s\n", error.name,
+				error.message);
+		dbus_error_free(&error);
+		failed = 1;
+	} else if (batch && !failed)
+		failed = batch_failed(reply);
+}
+
+/**
+ * Returns a fresh copy for every repetition since a message can only be
+ * sent once
+ */
+static DBusMessage *next_message(DBusMessage * message)
+{
+	if (count == 1)
+		return dbus_message_ref(message);
+
+	return dbus_message_copy(message);
+}
+
+/**
+ * Sends count method calls, keeping up to window of them in flight, and
+ * records the round trip time of each in send_ns
+ */
+static int send_method_calls(DBusMessage * message)
+{
+	long sent = 0;
+
+	while (completed < count) {
+		while (sent < count && sent - completed < window) {
+			DBusMessage *copy = next_message(message);
+
+			send_ns[sent] = monotonic_ns();
+			if (copy == NULL ||
+			    dbus_client_call_async(client, copy, -1,
+						   method_reply,
+						   (void *)sent) < 0) {
+				fprintf(stderr, "FAIL: Not enough memory\n");
+				return 1;
+			}
+			trace_event(trace, TRACE_CLIENT_SEND, unique_name,
+				    dbus_message_get_serial(copy), send_ns[sent]);
+			dbus_message_unref(copy);
+			sent++;
+		}
+
+		if (dbus_client_iterate(client, -1) < 0) {
+			fprintf(stderr, "FAIL: Connection is closed\n");
+			return 1;
+		}
+	}
+
+	return failed;
+}
+
+/**
+ * Sends count signals. When repeating, a Peer.Ping to the destination
+ * follows: its reply can only arrive after the service dequeued every
+ * signal, so the elapsed time covers their delivery.
+ */
+static int send_signals(DBusMessage * message)
+{
+	DBusConnection *connection = dbus_client_connection(client);
+	DBusMessage *ping;
+	long i;
+
+	for (i = 0; i < count; i++) {
+		DBusMessage *copy = next_message(message);
+		long long now = trace ? monotonic_ns() : 0;
+
+		if (copy == NULL || dbus_client_emit(client, copy) < 0) {
+			fprintf(stderr, "FAIL: Not enough memory\n");
+			return 1;
+		}
+		trace_event(trace, TRACE_CLIENT_SEND, unique_name,
+			    dbus_message_get_serial(copy), now);
+		dbus_message_unref(copy);
+
+		if (dbus_connection_get_outgoing_size(connection) >
+		    MAX_OUTGOING_SIZE)
+			dbus_client_flush(client);
+	}
+	dbus_client_flush(client);
+
+	if (count == 1 || name == NULL)
+		return 0;
+
+	ping = dbus_message_new_method_call(name, "/", DBUS_INTERFACE_PEER,
+					    "Ping");
+	if (ping == NULL) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		return 1;
+	}
+	send_ns[0] = monotonic_ns();
+	dbus_client_call_async(client, ping, -1, method_reply, (void *)0L);
+	dbus_message_unref(ping);
+
+	while (completed < 1) {
+		if (dbus_client_iterate(client, -1) < 0) {
+			fprintf(stderr, "FAIL: Connection is closed\n");
+			return 1;
+		}
+	}
+
+	return failed;
+}
+
+/* State of a --stream run */
+static long in_flight = 0;
+static unsigned long long streamed = 0;
+
+static int stream_reply_failed(DBusMessage * reply)
+{
+	DBusError error;
+
+	in_flight--;
+	dbus_error_init(&error);
+	if (dbus_set_error_from_message(&error, reply)) {
+		if (!failed)
+			fprintf(stderr, "FAIL: %s: %s\n", error.name,
+				error.message);
+		dbus_error_free(&error);
+		failed = 1;
+	}
+
+	return failed;
+}
+
+static void upload_reply(dbus_client * client, DBusMessage * reply,
+			 void *user_data)
+{
+	dbus_uint64_t received;
+
+	if (stream_reply_failed(reply))
+		return;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_UINT64, &received,
+				   DBUS_TYPE_INVALID)) {
+		fprintf(stderr, "FAIL: Malformed %s reply\n", STREAM_UPLOAD);
+		failed = 1;
+		return;
+	}
+	streamed = received;
+}
+
+static void download_reply(dbus_client * client, DBusMessage * reply,
+			   void *user_data)
+{
+	unsigned char *data;
+	int len;
+	dbus_uint32_t checksum;
+
+	if (stream_reply_failed(reply))
+		return;
+
+	if (!dbus_message_get_args(reply, NULL,
+				   DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &data, &len,
+				   DBUS_TYPE_UINT32, &checksum,
+				   DBUS_TYPE_INVALID)) {
+		fprintf(stderr, "FAIL: Malformed %s reply\n", STREAM_DOWNLOAD);
+		failed = 1;
+		return;
+	}
+	if (stream_checksum(data, len) != checksum) {
+		fprintf(stderr, "FAIL: Checksum mismatch in %d byte chunk\n",
+			len);
+		failed = 1;
+		return;
+	}
+	streamed += len;
+}
+
+/**
+ * Returns the method call moving the chunk at offset, or NULL when out of
+ * memory. Uploads fill it from buf.
+ */
+static DBusMessage *new_chunk(int upload, dbus_uint64_t id,
+			      dbus_uint64_t offset, dbus_uint32_t len,
+			      unsigned char *buf)
+{
+	DBusMessage *message;
+	dbus_uint32_t checksum;
+	dbus_bool_t ok;
+
+	message = dbus_message_new_method_call(name, path, interface, member);
+	if (message == NULL)
+		return NULL;
+
+	if (upload) {
+		stream_fill(buf, offset, len);
+		checksum = stream_checksum(buf, len);
+		ok = dbus_message_append_args(message,
+					      DBUS_TYPE_UINT64, &id,
+					      DBUS_TYPE_UINT64, &offset,
+					      DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+					      &buf, len,
+					      DBUS_TYPE_UINT32, &checksum,
+					      DBUS_TYPE_INVALID);
+	} else {
+		ok = dbus_message_append_args(message,
+					      DBUS_TYPE_UINT64, &offset,
+					      DBUS_TYPE_UINT32, &len,
+					      DBUS_TYPE_INVALID);
+	}
+
+	if (!ok) {
+		dbus_message_unref(message);
+		return NULL;
+	}
+
+	return message;
+}
+
+/**
+ * Moves stream_size bytes in chunks of chunk_size, with up to window chunks
+ * in flight, so memory is bounded by window * chunk_size whatever the size
+ * of the stream. An upload ends with an empty chunk, whose reply confirms
+ * the total the service received.
+ */
+static int do_stream(void)
+{
+	int upload = strcmp(member, STREAM_UPLOAD) == 0;
+	dbus_uint64_t id = getpid();
+	unsigned long long offset = 0;
+	int ended = !upload;
+	unsigned char *buf = NULL;
+	long long start_ns, elapsed_ns;
+
+	if (upload) {
+		buf = malloc(chunk_size);
+		if (buf == NULL) {
+			fprintf(stderr, "FAIL: Not enough memory\n");
+			return 1;
+		}
+	}
+
+	start_ns = monotonic_ns();
+	while (!failed && (offset < stream_size || !ended || in_flight > 0)) {
+		while (!failed && in_flight < window &&
+		       (offset < stream_size || !ended)) {
+			dbus_uint32_t len = chunk_size;
+			DBusMessage *message;
+
+			if (stream_size - offset < len)
+				len = stream_size - offset;
+			if (len == 0)
+				ended = 1;
+
+			message = new_chunk(upload, id, offset, len, buf);
+			if (message == NULL ||
+			    dbus_client_call_async(client, message, -1,
+						   upload ? upload_reply :
+						   download_reply, NULL) < 0) {
+				fprintf(stderr, "FAIL: Not enough memory\n");
+				free(buf);
+				return 1;
+			}
+			dbus_message_unref(message);
+			in_flight++;
+			offset += len;
+		}
+
+		if (dbus_client_iterate(client, -1) < 0) {
+			fprintf(stderr, "FAIL: Connection is closed\n");
+			free(buf);
+			return 1;
+		}
+	}
+	elapsed_ns = monotonic_ns() - start_ns;
+	free(buf);
+
+	if (failed)
+		return 1;
+
+	if (streamed != stream_size) {
+		fprintf(stderr, "FAIL: Streamed %llu of %llu bytes\n",
+			streamed, stream_size);
+		return 1;
+	}
+
+	printf("streamed %llu bytes in %.6f s (%.1f MB/s)\n", streamed,
+	       elapsed_ns / 1e9, elapsed_ns ? streamed * 1e3 / elapsed_ns : 0.0);
+
+	return 0;
+}
+
+/**
+ * Returns a Batch call to the destination of message, holding batch copies
+ * of message, or NULL when out of memory
+ */
+static DBusMessage *new_batch(DBusMessage * message)
+{
+	DBusMessage *batch_message;
+	DBusMessageIter args, requests, request;
+	long i;
+
+	batch_message = dbus_message_new_method_call(name, path, interface,
+						     BATCH_MEMBER);
+	if (batch_message == NULL)
+		return NULL;
+
+	dbus_message_iter_init_append(batch_message, &args);
+	if (!dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY,
+					      BATCH_ENTRY_SIGNATURE,
+					      &requests))
+		goto oom;
+
+	for (i = 0; i < batch; i++) {
+		if (!dbus_message_iter_open_container(&requests,
+						      DBUS_TYPE_STRUCT, NULL,
+						      &request) ||
+		    !dbus_message_iter_append_basic(&request, DBUS_TYPE_STRING,
+						    &member) ||
+		    pack_args(message, &request) < 0 ||
+		    !dbus_message_iter_close_container(&requests, &request)) {
+			dbus_message_iter_abandon_container(&args, &requests);
+			goto oom;
+		}
+	}
+
+	if (!dbus_message_iter_close_container(&args, &requests))
+		goto oom;
+
+	return batch_message;
+
+oom:
+	dbus_message_unref(batch_message);
+	return NULL;
+}
+
+static int write_stats(void)
+{
+	FILE *file;
+	long i;
+
+	file = fopen(stats_path, "w");
+	if (file == NULL) {
+		fprintf(stderr, "FAIL: Couldn't open stats file \"%s\": %m\n",
+			stats_path);
+		return 1;
+	}
+
+	if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+		for (i = 0; i < count; i++)
+			fprintf(file, "%lld\n", send_ns[i]);
+	}
+
+	if (fclose(file) != 0) {
+		fprintf(stderr, "FAIL: Couldn't write stats file \"%s\": %m\n",
+			stats_path);
+		return 1;
+	}
+
+	return 0;
+}
+
 static int do_message(int argc, char *argv[])
 {
 	DBusMessage *message;
 	DBusMessageIter iter;
-	int i = 0;
+	long long start_ns, elapsed_ns;
+	int rc;
 
 	if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL) {
 		message = dbus_message_new_method_call(NULL,
@@ -92,129 +536,56 @@ static int do_message(int argc, char *argv[])
 
 	dbus_message_iter_init_append(message, &iter);
 
-	while (i < argc) {
-		char *arg;
-		char *c;
-		int type;
-		int secondary_type;
-		int container_type;
-		DBusMessageIter *target_iter;
-		DBusMessageIter container_iter;
+	if (append_args(&iter, argc, argv))
+		return 1;
 
-		type = DBUS_TYPE_INVALID;
-		arg = argv[i++];
-		c = strchr(arg, ':');
+	/* from here on, count and send_ns are about Batch calls */
+	if (batch) {
+		DBusMessage *calls = message;
 
-		if (c == NULL) {
-			fprintf(stderr,
-				"FAIL: %s: Data item \"%s\" is badly formed\n",
-				argv[0], arg);
+		message = new_batch(calls);
+		dbus_message_unref(calls);
+		if (message == NULL) {
+			fprintf(stderr, "FAIL: Not enough memory\n");
 			return 1;
 		}
-
-		*(c++) = 0;
-
-		container_type = DBUS_TYPE_INVALID;
-
-		if (strcmp(arg, "variant") == 0)
-			container_type = DBUS_TYPE_VARIANT;
-		else if (strcmp(arg, "array") == 0)
-			container_type = DBUS_TYPE_ARRAY;
-		else if (strcmp(arg, "dict") == 0)
-			container_type = DBUS_TYPE_DICT_ENTRY;
-
-		if (container_type != DBUS_TYPE_INVALID) {
-			arg = c;
-			c = strchr(arg, ':');
-			if (c == NULL) {
-				fprintf(stderr,
-					"FAIL: %s: Data item \"%s\" is badly formed\n",
-					argv[0], arg);
-				return 1;
-			}
-			*(c++) = 0;
-		}
-
-		if (arg[0] == 0)
-			type = DBUS_TYPE_STRING;
-		else
-			type = type_from_name(arg);
-
-		if (container_type == DBUS_TYPE_DICT_ENTRY) {
-			char sig[5];
-			arg = c;
-			c = strchr(c, ':');
-			if (c == NULL) {
-				fprintf(stderr,
-					"FAIL: %s: Data item \"%s\" is badly formed\n",
-					argv[0], arg);
-				return 1;
-			}
-			*(c++) = 0;
-			secondary_type = type_from_name(arg);
-			sig[0] = DBUS_DICT_ENTRY_BEGIN_CHAR;
-			sig[1] = type;
-			sig[2] = secondary_type;
-			sig[3] = DBUS_DICT_ENTRY_END_CHAR;
-			sig[4] = '\0';
-			dbus_message_iter_open_container(&iter,
-							 DBUS_TYPE_ARRAY,
-							 sig, &container_iter);
-			target_iter = &container_iter;
-		} else if (container_type != DBUS_TYPE_INVALID) {
-			char sig[2];
-			sig[0] = type;
-			sig[1] = '\0';
-			dbus_message_iter_open_container(&iter,
-							 container_type,
-							 sig, &container_iter);
-			target_iter = &container_iter;
-		} else
-			target_iter = &iter;
-
-		if (container_type == DBUS_TYPE_ARRAY) {
-			append_array(target_iter, type, c);
-		} else if (container_type == DBUS_TYPE_DICT_ENTRY) {
-			append_dict(target_iter, type, secondary_type, c);
-		} else
-			append_arg(target_iter, type, c);
-
-		if (container_type != DBUS_TYPE_INVALID) {
-			dbus_message_iter_close_container(&iter,
-							  &container_iter);
-		}
+		count /= batch;
 	}
 
-	if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL) {
-		DBusMessage *reply;
-
-		log_message(log_fd, "sent ", message);
-		dbus_error_init(&error);
-		reply = dbus_connection_send_with_reply_and_block(connection,
-								  message, -1,
-								  &error);
-		if (dbus_error_is_set(&error)) {
-			fprintf(stderr, "FAIL: %s: %s\n",
-				error.name, error.message);
-			return 1;
-		}
-
-		if (reply) {
-			dbus_message_unref(reply);
-		}
-	} else {
-		log_message(log_fd, "sent ", message);
-		dbus_connection_send(connection, message, NULL);
-		dbus_connection_flush(connection);
+	send_ns = calloc(count, sizeof(*send_ns));
+	if (send_ns == NULL) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		return 1;
 	}
 
+	log_message(log_fd, "sent ", message);
+
+	start_ns = monotonic_ns();
+	if (message_type == DBUS_MESSAGE_TYPE_METHOD_CALL)
+		rc = send_method_calls(message);
+	else
+		rc = send_signals(message);
+	elapsed_ns = monotonic_ns() - start_ns;
+
+	if (rc == 0 && batch)
+		printf("sent %ld calls in %ld Batch messages in %.6f s (%.0f calls/s)\n",
+		       count * batch, count, elapsed_ns / 1e9,
+		       count * batch * 1e9 / elapsed_ns);
+	else if (rc == 0 && count > 1)
+		printf("sent %ld messages in %.6f s (%.0f msg/s)\n", count,
+		       elapsed_ns / 1e9, count * 1e9 / elapsed_ns);
+	if (rc == 0 && stats_path)
+		rc = write_stats();
+
+	free(send_ns);
 	dbus_message_unref(message);
 
-	return 0;
+	return rc;
 }
 
 int main(int argc, char *argv[])
 {
+	DBusError error;
 	int i, rc;
 
 	if (argc < 3)
@@ -243,6 +614,55 @@ int main(int argc, char *argv[])
 			name = strchr(arg, '=') + 1;
 		else if (strstr(arg, "--type=") == arg)
 			type_str = strchr(arg, '=') + 1;
+		else if (strstr(arg, "--count=") == arg) {
+			count = atol(strchr(arg, '=') + 1);
+			if (count < 1) {
+				fprintf(stderr,
+					"FAIL: \"--count=\" requires a positive N\n");
+				usage(1);
+			}
+		} else if (strstr(arg, "--window=") == arg) {
+			window = atol(strchr(arg, '=') + 1);
+			if (window < 1) {
+				fprintf(stderr,
+					"FAIL: \"--window=\" requires a positive W\n");
+				usage(1);
+			}
+		} else if (strstr(arg, "--stream=") == arg) {
+			long long size = parse_size(strchr(arg, '=') + 1);
+
+			if (size <= 0) {
+				fprintf(stderr,
+					"FAIL: \"--stream=\" requires a positive SIZE\n");
+				usage(1);
+			}
+			stream_size = size;
+		} else if (strstr(arg, "--chunk=") == arg) {
+			chunk_size = parse_size(strchr(arg, '=') + 1);
+			if (chunk_size < 1 || chunk_size > STREAM_MAX_CHUNK) {
+				fprintf(stderr,
+					"FAIL: \"--chunk=\" requires BYTES between 1 and %d\n",
+					STREAM_MAX_CHUNK);
+				usage(1);
+			}
+		} else if (strstr(arg, "--batch=") == arg) {
+			batch = atol(strchr(arg, '=') + 1);
+			if (batch < 1) {
+				fprintf(stderr,
+					"FAIL: \"--batch=\" requires a positive B\n");
+				usage(1);
+			}
+		} else if (strstr(arg, "--trace=") == arg)
+			trace_path = strchr(arg, '=') + 1;
+		else if (strstr(arg, "--trace-sample=") == arg) {
+			trace_sample = atoi(strchr(arg, '=') + 1);
+			if (trace_sample < 1) {
+				fprintf(stderr,
+					"FAIL: \"--trace-sample=\" requires a positive N\n");
+				usage(1);
+			}
+		} else if (strstr(arg, "--stats=") == arg)
+			stats_path = strchr(arg, '=') + 1;
 		else if (strstr(arg, "--log=") == arg) {
 			char *path = strchr(arg, '=') + 1;
 
@@ -297,14 +717,25 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	dbus_error_init(&error);
+	if (batch && (message_type != DBUS_MESSAGE_TYPE_METHOD_CALL ||
+		      name == NULL || count % batch != 0)) {
+		fprintf(stderr,
+			"FAIL: \"--batch=\" requires a NAME, method calls and a multiple of B as N\n");
+		usage(1);
+	}
 
-	if (address != NULL)
-		connection = dbus_connection_open(address, &error);
-	else
-		connection = dbus_bus_get(type, &error);
+	if (stream_size &&
+	    (i < argc || name == NULL ||
+	     (strcmp(member, STREAM_UPLOAD) && strcmp(member, STREAM_DOWNLOAD)))) {
+		fprintf(stderr,
+			"FAIL: \"--stream=\" requires a NAME, an Upload or Download member and no contents\n");
+		usage(1);
+	}
 
-	if (connection == NULL) {
+	dbus_error_init(&error);
+
+	client = dbus_client_open(address, type, &error);
+	if (client == NULL) {
 		fprintf(stderr,
 			"FAIL: Failed to open connection to \"%s\" message bus: %s\n",
 			(address !=
@@ -313,11 +744,25 @@ int main(int argc, char *argv[])
 					    "session"), error.message);
 		dbus_error_free(&error);
 		exit(1);
-	} else if (address != NULL)
-		dbus_bus_register(connection, &error);
+	}
 
-	rc = do_message(argc - i, argv + i);
-	dbus_connection_unref(connection);
+	unique_name = dbus_bus_get_unique_name(dbus_client_connection(client));
+
+	if (trace_path) {
+		trace = trace_open(trace_path, "dbus_message", trace_sample);
+		if (trace == NULL) {
+			dbus_client_close(client);
+			exit(1);
+		}
+	}
+
+	if (stream_size)
+		rc = do_stream();
+	else
+		rc = do_message(argc - i, argv + i);
+	if (trace_close(trace) < 0)
+		rc = 1;
+	dbus_client_close(client);
 	if (rc == 0)
 		printf("PASS\n");
 
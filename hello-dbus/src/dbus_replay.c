@@ -0,0 +1,350 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*- */
+/* dbus_replay.c  Re-sends the traffic recorded by dbus_service --capture
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "dbus_capture.h"
+#include "dbus_client.h"
+#include "dbus_common.h"
+
+/* Beyond this much unsent data, wait for the socket instead of queueing */
+#define MAX_OUTGOING_SIZE (1024 * 1024)
+
+/* Beyond this many calls waiting for their reply, wait instead of sending.
+ * Stays under the system bus's max_replies_per_connection of 128, beyond
+ * which the bus answers LimitsExceeded for the service.
+ */
+#define MAX_PENDING 64
+
+dbus_client *client;
+DBusBusType type = DBUS_BUS_SESSION;
+const char *name = NULL;
+const char *address = NULL;
+const char *capture_path = NULL;
+int session_or_system = FALSE;
+int log_fd = -1;
+double speed = 1.0;
+int timeout_ms = 25000;
+unsigned long replies = 0, errors = 0;
+
+static void usage(int ecode)
+{
+	char *prefix = ecode ? "FAIL: " : "";
+
+	fprintf(stderr,
+		"%6sUsage: dbus_replay [ADDRESS] [--name=NAME] [--speed=FACTOR | --fast] [--timeout=MS] <capture>\n"
+		"    ADDRESS\t\t--system, --session (default), or --address=ADDR\n"
+		"    NAME\t\tdestination replacing the unique names in the capture,\n"
+		"    \t\t\trequired when the capture has calls to unique names\n"
+		"    FACTOR\t\treplay FACTOR times faster than recorded (default 1)\n"
+		"    --fast\t\treplay as fast as possible, ignoring the recorded timing\n"
+		"    MS\t\t\thow long to wait for each reply (default 25000)\n"
+		"    capture\t\tfile written by dbus_service --capture\n",
+		prefix);
+	exit(ecode);
+}
+
+/**
+ * Only the method calls and signals that the service received from its
+ * clients are replayed; the bus's own messages and the replies are skipped.
+ */
+static int should_replay(struct capture_record *record, DBusMessage * message)
+{
+	const char *sender = dbus_message_get_sender(message);
+	int message_type = dbus_message_get_type(message);
+
+	if (record->direction != CAPTURE_RECEIVED)
+		return FALSE;
+	if (sender && strcmp(sender, DBUS_SERVICE_DBUS) == 0)
+		return FALSE;
+
+	return message_type == DBUS_MESSAGE_TYPE_METHOD_CALL ||
+	    message_type == DBUS_MESSAGE_TYPE_SIGNAL;
+}
+
+/**
+ * Returns a sendable copy of message: dbus_message_copy() resets the serial
+ * so the connection assigns a fresh one, and the unique names of the
+ * recorded run are replaced. Returns NULL upon error.
+ */
+static DBusMessage *prepare_message(DBusMessage * message)
+{
+	DBusMessage *copy;
+	const char *destination;
+
+	destination = dbus_message_get_destination(message);
+	if (destination && destination[0] == ':' && name == NULL) {
+		fprintf(stderr,
+			"FAIL: The capture has messages to the unique name \"%s\" of the recorded run, use \"--name=\"\n",
+			destination);
+		return NULL;
+	}
+
+	copy = dbus_message_copy(message);
+	if (copy == NULL)
+		goto oom;
+
+	if (name && !dbus_message_set_destination(copy, name)) {
+		dbus_message_unref(copy);
+		goto oom;
+	}
+	dbus_message_set_sender(copy, NULL);
+
+	return copy;
+
+oom:
+	fprintf(stderr, "FAIL: Not enough memory\n");
+	return NULL;
+}
+
+static void reply_received(dbus_client * client, DBusMessage * reply,
+			   void *user_data)
+{
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
+		errors++;
+	else
+		replies++;
+}
+
+/**
+ * Sends copy. Method calls expecting a reply are tracked until it arrives,
+ * so that the service's replies reach a connected client as they did when
+ * recorded. Returns -1 upon error.
+ */
+static int replay_message(DBusMessage * copy)
+{
+	if (dbus_message_get_type(copy) == DBUS_MESSAGE_TYPE_METHOD_CALL &&
+	    !dbus_message_get_no_reply(copy)) {
+		while (dbus_client_pending(client) >= MAX_PENDING) {
+			if (dbus_client_iterate(client, -1) < 0) {
+				fprintf(stderr, "FAIL: Connection is closed\n");
+				return -1;
+			}
+		}
+		if (dbus_client_call_async(client, copy, timeout_ms,
+					   reply_received, NULL) < 0) {
+			fprintf(stderr, "FAIL: Not enough memory\n");
+			return -1;
+		}
+	} else if (dbus_client_emit(client, copy) < 0) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sleep_until(long long deadline_ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline_ns / 1000000000LL;
+	ts.tv_nsec = deadline_ns % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) ;
+}
+
+static int do_replay(void)
+{
+	struct capture_record record;
+	capture_file *capture;
+	DBusMessage *message;
+	long long first_ns = -1, start_ns, elapsed_ns;
+	unsigned long replayed = 0, total = 0;
+	int rc;
+
+	capture = capture_open_read(capture_path);
+	if (capture == NULL)
+		return 1;
+
+	start_ns = monotonic_ns();
+
+	while ((rc = capture_read(capture, &record, &message)) > 0) {
+		DBusMessage *copy;
+
+		total++;
+		if (!should_replay(&record, message)) {
+			dbus_message_unref(message);
+			continue;
+		}
+
+		copy = prepare_message(message);
+		dbus_message_unref(message);
+		if (copy == NULL) {
+			rc = -1;
+			break;
+		}
+
+		if (first_ns < 0)
+			first_ns = record.timestamp_ns;
+		if (speed > 0)
+			sleep_until(start_ns +
+				    (long long)((record.timestamp_ns -
+						 first_ns) / speed));
+
+		log_message(log_fd, "sent ", copy);
+		if (replay_message(copy) < 0) {
+			dbus_message_unref(copy);
+			rc = -1;
+			break;
+		}
+		dbus_message_unref(copy);
+		replayed++;
+
+		if (dbus_client_dispatch(client) < 0) {
+			fprintf(stderr, "FAIL: Connection is closed\n");
+			rc = -1;
+			break;
+		}
+		if (speed > 0 ||
+		    dbus_connection_get_outgoing_size(dbus_client_connection
+						      (client)) >
+		    MAX_OUTGOING_SIZE)
+			dbus_client_flush(client);
+	}
+
+	dbus_client_flush(client);
+	capture_close(capture);
+	if (rc < 0)
+		return 1;
+
+	/* Calls that time out complete with a NoReply error */
+	while (dbus_client_pending(client) > 0) {
+		if (dbus_client_iterate(client, -1) < 0) {
+			fprintf(stderr, "FAIL: Connection is closed\n");
+			return 1;
+		}
+	}
+
+	elapsed_ns = monotonic_ns() - start_ns;
+	printf("replayed %lu of %lu messages in %.3f s (%.0f msg/s)\n",
+	       replayed, total, elapsed_ns / 1e9,
+	       elapsed_ns ? replayed * 1e9 / elapsed_ns : 0.0);
+	printf("received %lu replies and %lu errors\n", replies, errors);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	DBusError error;
+	int i, rc;
+
+	if (argc < 2)
+		usage(1);
+
+	for (i = 1; i < argc; i++) {
+		char *arg = argv[i];
+
+		if (strcmp(arg, "--system") == 0) {
+			type = DBUS_BUS_SYSTEM;
+			session_or_system = TRUE;
+		} else if (strcmp(arg, "--session") == 0) {
+			type = DBUS_BUS_SESSION;
+			session_or_system = TRUE;
+		} else if (strstr(arg, "--address") == arg) {
+			address = strchr(arg, '=');
+
+			if (address == NULL) {
+				fprintf(stderr,
+					"FAIL: \"--address=\" requires an ADDRESS\n");
+				usage(1);
+			} else {
+				address = address + 1;
+			}
+		} else if (strstr(arg, "--name=") == arg)
+			name = strchr(arg, '=') + 1;
+		else if (strstr(arg, "--speed=") == arg) {
+			speed = strtod(strchr(arg, '=') + 1, NULL);
+			if (speed <= 0) {
+				fprintf(stderr,
+					"FAIL: \"--speed=\" requires a positive FACTOR\n");
+				usage(1);
+			}
+		} else if (strcmp(arg, "--fast") == 0)
+			speed = 0;
+		else if (strstr(arg, "--timeout=") == arg) {
+			char *end;
+
+			timeout_ms = strtol(strchr(arg, '=') + 1, &end, 10);
+			if (*end != '\0' || timeout_ms <= 0) {
+				fprintf(stderr,
+					"FAIL: \"--timeout=\" requires a positive MS\n");
+				usage(1);
+			}
+		}
+		else if (strstr(arg, "--log=") == arg) {
+			char *path = strchr(arg, '=') + 1;
+
+			log_fd = open(path, O_CREAT | O_TRUNC | O_WRONLY,
+				      S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP |
+				      S_IROTH | S_IWOTH);
+			if (log_fd < 0) {
+				fprintf(stderr,
+					"FAIL: Couldn't open log file \"%s\": %m\n",
+					path);
+				exit(1);
+			}
+		} else if (!strcmp(arg, "--help"))
+			usage(0);
+		else if (arg[0] == '-' || capture_path != NULL)
+			usage(1);
+		else
+			capture_path = arg;
+	}
+
+	if (capture_path == NULL)
+		usage(1);
+
+	if (session_or_system && address != NULL) {
+		fprintf(stderr,
+			"FAIL: \"--address\" may not be used with \"--system\" or \"--session\"\n");
+		usage(1);
+	}
+
+	dbus_error_init(&error);
+
+	client = dbus_client_open(address, type, &error);
+	if (client == NULL) {
+		fprintf(stderr,
+			"FAIL: Failed to open connection to \"%s\" message bus: %s\n",
+			(address !=
+			 NULL) ? address : ((type ==
+					     DBUS_BUS_SYSTEM) ? "system" :
+					    "session"), error.message);
+		dbus_error_free(&error);
+		exit(1);
+	}
+
+	rc = do_replay();
+	dbus_client_close(client);
+	if (rc == 0)
+		printf("PASS\n");
+
+	exit(rc);
+}
@@ -24,18 +24,30 @@
  */
 
 #define _GNU_SOURCE
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <unistd.h>
 #include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include "dbus_capture.h"
+#include "dbus_client.h"
 #include "dbus_common.h"
+#include "dbus_stream.h"
+#include "dbus_trace.h"
 
 static int terminate = 0;
+dbus_client *client = NULL;
 DBusConnection *connection = NULL;
 DBusError error;
 DBusBusType type = DBUS_BUS_SESSION;
@@ -47,17 +59,610 @@ const char *address = NULL;
 int session_or_system = FALSE;
 int log_fd = -1;
 int lock_fd = 0;
+capture_file *capture = NULL;
+int capture_failed = 0;
+const char *trace_path = NULL;
+int trace_sample = TRACE_DEFAULT_SAMPLE;
+trace_file *trace = NULL;
+long long busy_poll_ns = 0;
+int cpu = -1;
+int rt_priority = 0;
+unsigned long handled = 0;
+long long max_received_size = -1;
+long long max_message_size = -1;
+long long flush_threshold = 0;
+int report_interval = 0;
+
+#define DEFAULT_BUSY_POLL_US 50
+#define DEFAULT_RT_PRIORITY 10
+
+/* Largest Batch reply: the max_message_size of the system bus, the lowest
+ * of the standard bus configurations; room is left for the header and the
+ * results array.
+ */
+#define BATCH_MAX_REPLY_SIZE (32 * 1024 * 1024)
+#define BATCH_REPLY_HEADER_SIZE 1024
+
+/* Uploads in progress, keyed by sender and stream id. They end with their
+ * last chunk, an error or their sender leaving the bus; when the table is
+ * full, an upload idle for STREAM_IDLE_TIMEOUT seconds gives up its slot.
+ */
+#define MAX_STREAMS 32
+#define STREAM_IDLE_TIMEOUT 60
+
+/* Tells the service when a client holding upload slots leaves the bus; one
+ * rule is added per such client, so other clients don't wake the service.
+ */
+#define SENDER_GONE_MATCH \
+	"type='signal',sender='" DBUS_SERVICE_DBUS "',path='" DBUS_PATH_DBUS \
+	"',interface='" DBUS_INTERFACE_DBUS "',member='NameOwnerChanged'," \
+	"arg0='%s',arg2=''"
+
+struct upload {
+	int used;
+	char sender[DBUS_MAXIMUM_NAME_LENGTH + 1];
+	dbus_uint64_t id;
+	dbus_uint64_t received;
+	long long last_ns;	/* CLOCK_MONOTONIC, of the last chunk */
+};
+
+static struct upload uploads[MAX_STREAMS];
+
+/* Download chunks are generated here, grown to the largest chunk asked for */
+static unsigned char *chunk_buf = NULL;
+static size_t chunk_buf_size = 0;
 
 static void usage(void)
 {
 	fprintf(stderr,
-		"Usage: dbus_service [ADDRESS] --name=<NAME> <path> <interface>\n\n"
+		"Usage: dbus_service [ADDRESS] [--capture=FILE] [TRACE] [LATENCY] [MEMORY] --name=<NAME> <path> <interface>\n\n"
 		"    ADDRESS\t\t--system, --session (default), or --address=ADDR\n"
+		"    FILE\t\trecord every message sent and received, for dbus_replay\n"
+		"    TRACE\t\t--trace=FILE to record the timing of one in\n"
+		"         \t\t--trace-sample=N calls (default %d), for dbus_trace_merge.py\n"
+		"    LATENCY\t\t--busy-poll[=US] to spin for US microseconds (default %d)\n"
+		"           \t\tafter each message before blocking, --cpu=N to pin the\n"
+		"           \t\tservice to CPU N and --rt[=PRIO] for SCHED_FIFO (default\n"
+		"           \t\tpriority %d). Combine --rt with --busy-poll only on a CPU\n"
+		"           \t\tthat the bus daemon doesn't run on. --flush-threshold=BYTES\n"
+		"           \t\tlets up to BYTES of replies queue before they are written\n"
+		"           \t\t(default 0, each reply at once), fewer writes for more\n"
+		"           \t\tlatency and memory.\n"
+		"    MEMORY\t\t--max-received-size=BYTES to stop reading from the bus\n"
+		"          \t\tbeyond BYTES of queued messages and --max-message-size=BYTES,\n"
+		"          \t\twhich must not be below the bus's own maximum, with K, M or\n"
+		"          \t\tG suffixes, and --report=SECONDS to print the memory use\n"
 		"    NAME\t\tthe well-known name to bind to\n"
 		"    path\t\tpath to object (such as /org/freedesktop/DBus)\n"
 		"    interface\t\tinterface to use (such as org.freedesktop.DBus)\n\n"
 		"    The method <interface>.Method replies with an empty method_reply message.\n"
-		"    The signal <interface>.Signal is accepted by the service.\n");
+		"    The signal <interface>.Signal is accepted by the service.\n"
+		"    The methods <interface>.Upload and <interface>.Download transfer chunked\n"
+		"    streams, see dbus_stream.h.\n"
+		"    The method <interface>.Batch calls several of the above in one message,\n"
+		"    see dbus_common.h.\n",
+		TRACE_DEFAULT_SAMPLE, DEFAULT_BUSY_POLL_US, DEFAULT_RT_PRIORITY);
+}
+
+/**
+ * Stops capturing upon the first write error rather than failing every
+ * message after it
+ */
+static void capture_message(int direction, DBusMessage * message)
+{
+	if (capture && capture_write(capture, direction, message) < 0) {
+		capture_close(capture);
+		capture = NULL;
+		capture_failed = 1;
+	}
+}
+
+static void send_reply(DBusMessage * reply)
+{
+	const char *destination;
+	dbus_uint32_t serial;
+	int traced;
+
+	if (reply == NULL) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		return;
+	}
+
+	destination = dbus_message_get_destination(reply);
+	serial = dbus_message_get_reply_serial(reply);
+	traced = trace_sampled(trace, serial);
+	if (traced)
+		trace_event(trace, TRACE_HANDLER_END, destination, serial,
+			    monotonic_ns());
+
+	log_message(log_fd, "sent ", reply);
+	dbus_connection_send(connection, reply, NULL);
+	/* after sending, so that the captured reply carries its serial */
+	capture_message(CAPTURE_SENT, reply);
+	/* what isn't flushed here is written by the next dbus_client_iterate() */
+	if (dbus_connection_get_outgoing_size(connection) > flush_threshold)
+		dbus_connection_flush(connection);
+
+	if (traced)
+		trace_event(trace, TRACE_REPLY_SEND, destination, serial,
+			    monotonic_ns());
+	dbus_message_unref(reply);
+}
+
+static DBusMessage *invalid_args(DBusMessage * message, const char *format,
+				 ...)
+{
+	DBusMessage *reply;
+	va_list ap;
+	char *text;
+
+	va_start(ap, format);
+	if (vasprintf(&text, format, ap) < 0)
+		text = NULL;
+	va_end(ap);
+
+	reply = dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, text);
+	free(text);
+
+	return reply;
+}
+
+static struct upload *find_upload(const char *sender, dbus_uint64_t id)
+{
+	int i;
+
+	for (i = 0; i < MAX_STREAMS; i++) {
+		if (uploads[i].used && uploads[i].id == id &&
+		    strcmp(uploads[i].sender, sender) == 0)
+			return &uploads[i];
+	}
+
+	return NULL;
+}
+
+static int sender_uploads(const char *sender)
+{
+	int i, n = 0;
+
+	for (i = 0; i < MAX_STREAMS; i++) {
+		if (uploads[i].used && strcmp(uploads[i].sender, sender) == 0)
+			n++;
+	}
+
+	return n;
+}
+
+/**
+ * Adds or removes the match rule for sender leaving the bus. Errors aren't
+ * waited for: a missed signal only leaves slots to the idle timeout.
+ */
+static void watch_sender(const char *sender, int watch)
+{
+	char rule[sizeof(SENDER_GONE_MATCH) + DBUS_MAXIMUM_NAME_LENGTH];
+
+	if (sender[0] == '\0')
+		return;
+
+	snprintf(rule, sizeof(rule), SENDER_GONE_MATCH, sender);
+	if (watch)
+		dbus_bus_add_match(connection, rule, NULL);
+	else
+		dbus_bus_remove_match(connection, rule, NULL);
+}
+
+static void end_upload(struct upload *upload)
+{
+	upload->used = 0;
+	if (sender_uploads(upload->sender) == 0)
+		watch_sender(upload->sender, 0);
+}
+
+/**
+ * Returns a free slot, or the one idle for longest if that is beyond
+ * STREAM_IDLE_TIMEOUT, or NULL
+ */
+static struct upload *new_upload(const char *sender, dbus_uint64_t id)
+{
+	long long idle_before = monotonic_ns() -
+	    STREAM_IDLE_TIMEOUT * 1000000000LL;
+	struct upload *upload = NULL;
+	int i;
+
+	for (i = 0; i < MAX_STREAMS; i++) {
+		if (!uploads[i].used) {
+			upload = &uploads[i];
+			break;
+		}
+		if (uploads[i].last_ns < idle_before &&
+		    (upload == NULL || uploads[i].last_ns < upload->last_ns))
+			upload = &uploads[i];
+	}
+
+	if (upload == NULL)
+		return NULL;
+
+	if (upload->used)
+		end_upload(upload);
+	if (sender_uploads(sender) == 0)
+		watch_sender(sender, 1);
+
+	upload->used = 1;
+	snprintf(upload->sender, sizeof(upload->sender), "%s", sender);
+	upload->id = id;
+	upload->received = 0;
+	return upload;
+}
+
+/**
+ * Ends the uploads of a client that left the bus without finishing them
+ */
+static void sender_gone(DBusMessage * message)
+{
+	const char *gone, *old_owner, *new_owner;
+	int i;
+
+	if (!dbus_message_get_args(message, NULL,
+				   DBUS_TYPE_STRING, &gone,
+				   DBUS_TYPE_STRING, &old_owner,
+				   DBUS_TYPE_STRING, &new_owner,
+				   DBUS_TYPE_INVALID) || new_owner[0] != '\0')
+		return;
+
+	for (i = 0; i < MAX_STREAMS; i++) {
+		if (uploads[i].used && strcmp(uploads[i].sender, gone) == 0)
+			end_upload(&uploads[i]);
+	}
+}
+
+/**
+ * Only the position within each stream is kept, so memory doesn't depend on
+ * the size of the streams. A failed chunk ends its stream.
+ */
+static DBusMessage *handle_upload(DBusMessage * message)
+{
+	const char *sender = dbus_message_get_sender(message);
+	dbus_uint64_t id, offset;
+	dbus_uint32_t checksum;
+	unsigned char *data;
+	int len;
+	struct upload *upload;
+	DBusMessage *reply;
+	DBusError error;
+
+	dbus_error_init(&error);
+	if (!dbus_message_get_args(message, &error,
+				   DBUS_TYPE_UINT64, &id,
+				   DBUS_TYPE_UINT64, &offset,
+				   DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &data, &len,
+				   DBUS_TYPE_UINT32, &checksum,
+				   DBUS_TYPE_INVALID)) {
+		reply = dbus_message_new_error(message, error.name,
+					       error.message);
+		dbus_error_free(&error);
+		return reply;
+	}
+
+	if (sender == NULL)
+		sender = "";
+
+	upload = find_upload(sender, id);
+	if (offset == 0) {
+		if (upload == NULL)
+			upload = new_upload(sender, id);
+		if (upload == NULL)
+			return dbus_message_new_error(message,
+						      DBUS_ERROR_LIMITS_EXCEEDED,
+						      "Too many streams");
+		upload->received = 0;
+	} else if (upload == NULL) {
+		return invalid_args(message, "Unknown stream %llu",
+				    (unsigned long long)id);
+	}
+
+	if (offset != upload->received) {
+		end_upload(upload);
+		return invalid_args(message,
+				    "Chunk at offset %llu, expected %llu",
+				    (unsigned long long)offset,
+				    (unsigned long long)upload->received);
+	}
+
+	if (stream_checksum(data, len) != checksum) {
+		end_upload(upload);
+		return invalid_args(message, "Checksum mismatch at offset %llu",
+				    (unsigned long long)offset);
+	}
+
+	upload->received += len;
+	upload->last_ns = monotonic_ns();
+	if (len == 0)
+		end_upload(upload);
+
+	reply = dbus_message_new_method_return(message);
+	if (reply && !dbus_message_append_args(reply,
+					       DBUS_TYPE_UINT64,
+					       &upload->received,
+					       DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	return reply;
+}
+
+static DBusMessage *handle_download(DBusMessage * message)
+{
+	dbus_uint64_t offset;
+	dbus_uint32_t length, checksum;
+	DBusMessage *reply;
+	DBusError error;
+
+	dbus_error_init(&error);
+	if (!dbus_message_get_args(message, &error,
+				   DBUS_TYPE_UINT64, &offset,
+				   DBUS_TYPE_UINT32, &length,
+				   DBUS_TYPE_INVALID)) {
+		reply = dbus_message_new_error(message, error.name,
+					       error.message);
+		dbus_error_free(&error);
+		return reply;
+	}
+
+	if (length > STREAM_MAX_CHUNK)
+		return invalid_args(message,
+				    "Chunk of %u bytes is larger than %d",
+				    length, STREAM_MAX_CHUNK);
+
+	if (length > chunk_buf_size) {
+		unsigned char *buf = realloc(chunk_buf, length);
+
+		if (buf == NULL)
+			return NULL;
+		chunk_buf = buf;
+		chunk_buf_size = length;
+	}
+
+	stream_fill(chunk_buf, offset, length);
+	checksum = stream_checksum(chunk_buf, length);
+
+	reply = dbus_message_new_method_return(message);
+	if (reply && !dbus_message_append_args(reply,
+					       DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE,
+					       &chunk_buf, length,
+					       DBUS_TYPE_UINT32, &checksum,
+					       DBUS_TYPE_INVALID)) {
+		dbus_message_unref(reply);
+		reply = NULL;
+	}
+
+	return reply;
+}
+
+static DBusMessage *handle_batch(DBusMessage * message);
+
+/**
+ * Returns the reply to the method call message, or NULL when out of memory
+ */
+static DBusMessage *call_method(DBusMessage * message)
+{
+	if (dbus_message_is_method_call(message, interface, "Method"))
+		return dbus_message_new_method_return(message);
+	if (dbus_message_is_method_call(message, interface, STREAM_UPLOAD))
+		return handle_upload(message);
+	if (dbus_message_is_method_call(message, interface, STREAM_DOWNLOAD))
+		return handle_download(message);
+	if (dbus_message_is_method_call(message, interface, BATCH_MEMBER))
+		return handle_batch(message);
+
+	return dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_METHOD, NULL);
+}
+
+/**
+ * Returns the reply to the request at iter of the Batch call batch, as if
+ * the request had been called on its own
+ */
+static DBusMessage *call_batched(DBusMessage * batch, DBusMessageIter * iter)
+{
+	DBusMessageIter request;
+	DBusMessage *call, *reply;
+	const char *member;
+
+	dbus_message_iter_recurse(iter, &request);
+	dbus_message_iter_get_basic(&request, &member);
+	dbus_message_iter_next(&request);
+
+	if (!dbus_validate_member(member, NULL))
+		return invalid_args(batch, "Invalid member \"%s\"", member);
+	if (strcmp(member, BATCH_MEMBER) == 0)
+		return invalid_args(batch, "Batch calls can't be nested");
+
+	call = dbus_message_new_method_call(NULL, path, interface, member);
+	if (call == NULL)
+		return NULL;
+
+	/* the sender keys uploads, and replies need a serial to refer to */
+	if (!dbus_message_set_sender(call, dbus_message_get_sender(batch))) {
+		dbus_message_unref(call);
+		return NULL;
+	}
+	dbus_message_set_serial(call, dbus_message_get_serial(batch));
+
+	if (unpack_args(&request, call) < 0)
+		reply = invalid_args(batch,
+				     "Arguments of %s don't match their signature or hold unix fds",
+				     member);
+	else
+		reply = call_method(call);
+
+	dbus_message_unref(call);
+	return reply;
+}
+
+/**
+ * Returns an upper bound of the bytes that the result of call_reply adds to
+ * a Batch reply: the struct, the error name, then what pack_args() appends
+ */
+static long batch_result_size(DBusMessage * call_reply, const char *error_name)
+{
+	return 7 + 4 + strlen(error_name) + 1 +
+	    4 + strlen(dbus_message_get_signature(call_reply)) + 1 +
+	    1 + DBUS_MAXIMUM_SIGNATURE_LENGTH + 1 + 7 + args_size(call_reply);
+}
+
+/**
+ * Calls each request in order; a failed request doesn't stop the others.
+ * A result that would take the reply past BATCH_MAX_REPLY_SIZE, or the
+ * largest message the connection accepts, is replaced by a LimitsExceeded
+ * error, since the bus disconnects a service sending a message larger than
+ * its own limit.
+ */
+static DBusMessage *handle_batch(DBusMessage * message)
+{
+	DBusMessageIter args, requests, results, result;
+	DBusMessage *reply;
+	long size = BATCH_REPLY_HEADER_SIZE;
+	long max_size = dbus_connection_get_max_message_size(connection);
+
+	if (max_size > BATCH_MAX_REPLY_SIZE)
+		max_size = BATCH_MAX_REPLY_SIZE;
+
+	if (!dbus_message_has_signature(message, BATCH_SIGNATURE))
+		return invalid_args(message, "Batch takes \"%s\"",
+				    BATCH_SIGNATURE);
+
+	reply = dbus_message_new_method_return(message);
+	if (reply == NULL)
+		return NULL;
+
+	dbus_message_iter_init(message, &args);
+	dbus_message_iter_recurse(&args, &requests);
+	dbus_message_iter_init_append(reply, &args);
+	if (!dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY,
+					      BATCH_ENTRY_SIGNATURE,
+					      &results))
+		goto oom;
+
+	while (dbus_message_iter_get_arg_type(&requests) == DBUS_TYPE_STRUCT) {
+		DBusMessage *call_reply = call_batched(message, &requests);
+		const char *error_name;
+
+		if (call_reply == NULL)
+			goto oom_results;
+
+		error_name = dbus_message_get_error_name(call_reply);
+		if (error_name == NULL)
+			error_name = "";
+
+		if (size + batch_result_size(call_reply, error_name) > max_size) {
+			char text[64];
+
+			snprintf(text, sizeof(text),
+				 "Batch reply would exceed %ld bytes", max_size);
+			dbus_message_unref(call_reply);
+			call_reply = dbus_message_new_error(message,
+							    DBUS_ERROR_LIMITS_EXCEEDED,
+							    text);
+			if (call_reply == NULL)
+				goto oom_results;
+			error_name = DBUS_ERROR_LIMITS_EXCEEDED;
+
+			/* not even the error fits, fail the Batch call itself */
+			if (size + batch_result_size(call_reply, error_name) >
+			    max_size) {
+				dbus_message_iter_abandon_container(&args,
+								    &results);
+				dbus_message_unref(reply);
+				return call_reply;
+			}
+		}
+		size += batch_result_size(call_reply, error_name);
+
+		if (!dbus_message_iter_open_container(&results,
+						      DBUS_TYPE_STRUCT, NULL,
+						      &result) ||
+		    !dbus_message_iter_append_basic(&result, DBUS_TYPE_STRING,
+						    &error_name) ||
+		    pack_args(call_reply, &result) < 0 ||
+		    !dbus_message_iter_close_container(&results, &result)) {
+			dbus_message_unref(call_reply);
+			goto oom_results;
+		}
+		dbus_message_unref(call_reply);
+
+		dbus_message_iter_next(&requests);
+	}
+
+	if (!dbus_message_iter_close_container(&args, &results))
+		goto oom;
+
+	return reply;
+
+oom_results:
+	dbus_message_iter_abandon_container(&args, &results);
+oom:
+	dbus_message_unref(reply);
+	return NULL;
+}
+
+static DBusHandlerResult handle_message(dbus_client * client,
+					DBusMessage * message, void *user_data)
+{
+	const char *sender = dbus_message_get_sender(message);
+	dbus_uint32_t serial = dbus_message_get_serial(message);
+
+	/* only the upload table asked for these, they aren't client traffic */
+	if (dbus_message_is_signal(message, DBUS_INTERFACE_DBUS,
+				   "NameOwnerChanged") &&
+	    dbus_message_has_sender(message, DBUS_SERVICE_DBUS)) {
+		sender_gone(message);
+		return DBUS_HANDLER_RESULT_HANDLED;
+	}
+
+	if (trace_sampled(trace, serial)) {
+		trace_event(trace, TRACE_SERVICE_RECEIVE, sender, serial,
+			    dbus_client_read_ns(client));
+		trace_event(trace, TRACE_HANDLER_START, sender, serial,
+			    monotonic_ns());
+	}
+
+	handled++;
+	log_message(log_fd, "received ", message);
+	capture_message(CAPTURE_RECEIVED, message);
+
+	/* replies end their handler in send_reply() */
+	if (dbus_message_is_signal(message, interface, "Signal")) {
+		if (trace_sampled(trace, serial))
+			trace_event(trace, TRACE_HANDLER_END, sender, serial,
+				    monotonic_ns());
+	} else if (dbus_message_get_type(message) ==
+		   DBUS_MESSAGE_TYPE_METHOD_CALL) {
+		send_reply(call_method(message));
+	}
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/**
+ * Spins on non-blocking reads until no message arrived for busy_poll_ns,
+ * trading CPU time for the scheduler wakeup of a blocking read
+ */
+static int busy_poll(void)
+{
+	long long deadline = monotonic_ns() + busy_poll_ns;
+
+	while (!terminate) {
+		unsigned long before = handled;
+
+		if (dbus_client_dispatch(client) < 0)
+			return -1;
+
+		if (handled != before)
+			deadline = monotonic_ns() + busy_poll_ns;
+		else if (monotonic_ns() >= deadline)
+			break;
+	}
+
+	return 0;
 }
 
 /**
@@ -65,60 +670,57 @@ static void usage(void)
  */
 static int handle_messages(void)
 {
-	DBusMessage *message;
-
-	if (!dbus_connection_read_write(connection, 250)) {
-		fprintf(stderr, "FAIL: Connecion is closed\n");
+	if (busy_poll_ns > 0 && busy_poll() < 0) {
+		fprintf(stderr, "FAIL: Connection is closed\n");
 		return -1;
 	}
 
-	for (;;) {
-		message = dbus_connection_pop_message(connection);
-		if (message == NULL)
-			return 0;
-
-		log_message(log_fd, "received ", message);
-
-		if (dbus_message_is_signal(message, interface, "Signal")) {
-			dbus_message_unref(message);
-			continue;
-		} else
-		    if (dbus_message_is_method_call
-			(message, interface, "Method")) {
-			DBusMessage *reply;
-
-			reply = dbus_message_new_method_return(message);
-			dbus_message_unref(message);
-
-			log_message(log_fd, "sent ", reply);
-			dbus_connection_send(connection, reply, NULL);
-			dbus_connection_flush(connection);
-			dbus_message_unref(reply);
-			continue;
-		} else if (dbus_message_get_type(message) ==
-			   DBUS_MESSAGE_TYPE_METHOD_CALL) {
-			DBusMessage *reply;
-
-			reply =
-			    dbus_message_new_error(message,
-						   DBUS_ERROR_UNKNOWN_METHOD,
-						   NULL);
-			dbus_message_unref(message);
-
-			log_message(log_fd, "sent ", reply);
-			dbus_connection_send(connection, reply, NULL);
-			dbus_connection_flush(connection);
-			dbus_message_unref(reply);
-			continue;
-		} else {
-			dbus_message_unref(message);
-			continue;
-		}
+	if (dbus_client_iterate(client, 250) < 0) {
+		fprintf(stderr, "FAIL: Connection is closed\n");
+		return -1;
 	}
 
 	return 0;
 }
 
+static size_t heap_in_use(void)
+{
+#if __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 info = mallinfo2();
+#else
+	struct mallinfo info = mallinfo();
+#endif
+
+	return (size_t)info.uordblks + (size_t)info.hblkhd;
+}
+
+/**
+ * The incoming queue of libdbus can't be inspected, it is bounded by
+ * --max-received-size instead; socket is what the kernel holds on top of it.
+ */
+static void report_memory(void)
+{
+	long size, resident = 0;
+	int unread = 0, fd;
+	FILE *statm;
+
+	statm = fopen("/proc/self/statm", "r");
+	if (statm) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+			resident = 0;
+		fclose(statm);
+	}
+
+	fd = dbus_client_get_fd(client);
+	if (fd < 0 || ioctl(fd, FIONREAD, &unread) < 0)
+		unread = 0;
+
+	printf("memory: rss=%ld KiB heap=%zu KiB socket=%d B outgoing=%ld B handled=%lu\n",
+	       resident * (sysconf(_SC_PAGESIZE) / 1024), heap_in_use() / 1024,
+	       unread, dbus_connection_get_outgoing_size(connection), handled);
+	fflush(stdout);
+}
+
 void sigterm_handler(int signum)
 {
 	terminate = 1;
@@ -141,6 +743,64 @@ static int setup_signal_handling(void)
 	return 0;
 }
 
+/**
+ * Real-time scheduling is best effort since it usually needs privileges;
+ * an explicit CPU that can't be used is an error.
+ */
+static int setup_scheduling(void)
+{
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+			fprintf(stderr, "FAIL: Couldn't pin to CPU %d: %m\n",
+				cpu);
+			return 1;
+		}
+	}
+
+	if (rt_priority > 0) {
+		struct sched_param param;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = rt_priority;
+		if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK,
+				       &param) < 0) {
+			int err = errno;
+
+			if (err != EPERM) {
+				fprintf(stderr,
+					"FAIL: Couldn't set SCHED_FIFO priority %d: %s\n",
+					rt_priority, strerror(err));
+				return 1;
+			}
+			fprintf(stderr,
+				"WARN: SCHED_FIFO not permitted, using the default scheduler\n");
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Parses the value of an option as a number between min and max. Returns -1
+ * when it isn't one.
+ */
+static int parse_number(const char *value, long min, long max, long *number)
+{
+	char *end;
+
+	errno = 0;
+	*number = strtol(value, &end, 10);
+	if (errno || end == value || *end != '\0' || *number < min ||
+	    *number > max)
+		return -1;
+
+	return 0;
+}
+
 static int unlock_fd(void)
 {
 	int rc;
@@ -157,6 +817,7 @@ static int unlock_fd(void)
 
 static int do_service(void)
 {
+	long long next_report;
 	int rc;
 
 	rc = dbus_bus_request_name(connection, name,
@@ -173,9 +834,17 @@ static int do_service(void)
 		return 1;
 
 	rc = 0;
-	while (!terminate && !rc)
+	next_report = monotonic_ns() + report_interval * 1000000000LL;
+	while (!terminate && !rc) {
 		rc = handle_messages();
 
+		if (report_interval && monotonic_ns() >= next_report) {
+			report_memory();
+			next_report = monotonic_ns() +
+			    report_interval * 1000000000LL;
+		}
+	}
+
 	/* If we've received SIGTERM, try one last time to drain the incoming queue */
 	if (terminate && !rc)
 		rc = handle_messages();
@@ -247,6 +916,94 @@ int main(int argc, char *argv[])
 					path);
 				exit(1);
 			}
+		} else if (strstr(arg, "--capture=") == arg) {
+			capture = capture_open_write(strchr(arg, '=') + 1);
+			if (capture == NULL)
+				exit(1);
+		} else if (strstr(arg, "--trace=") == arg)
+			trace_path = strchr(arg, '=') + 1;
+		else if (strstr(arg, "--trace-sample=") == arg) {
+			trace_sample = atoi(strchr(arg, '=') + 1);
+			if (trace_sample < 1) {
+				fprintf(stderr,
+					"FAIL: \"--trace-sample=\" requires a positive N\n");
+				usage();
+				rc = 1;
+				goto out;
+			}
+		} else if (strstr(arg, "--max-received-size=") == arg ||
+			   strstr(arg, "--max-message-size=") == arg ||
+			   strstr(arg, "--flush-threshold=") == arg) {
+			long long size = parse_size(strchr(arg, '=') + 1);
+
+			if (size < 0 || size > LONG_MAX) {
+				fprintf(stderr,
+					"FAIL: \"%.*s\" requires BYTES\n",
+					(int)(strchr(arg, '=') - arg + 1), arg);
+				usage();
+				rc = 1;
+				goto out;
+			}
+			if (strstr(arg, "--max-received-size=") == arg)
+				max_received_size = size;
+			else if (strstr(arg, "--max-message-size=") == arg)
+				max_message_size = size;
+			else
+				flush_threshold = size;
+		} else if (strstr(arg, "--report=") == arg) {
+			report_interval = atoi(strchr(arg, '=') + 1);
+			if (report_interval < 1) {
+				fprintf(stderr,
+					"FAIL: \"--report=\" requires a positive SECONDS\n");
+				usage();
+				rc = 1;
+				goto out;
+			}
+		} else if (strcmp(arg, "--busy-poll") == 0)
+			busy_poll_ns = DEFAULT_BUSY_POLL_US * 1000LL;
+		else if (strstr(arg, "--busy-poll=") == arg) {
+			long us;
+
+			if (parse_number(strchr(arg, '=') + 1, 0, 1000000,
+					 &us) < 0) {
+				fprintf(stderr,
+					"FAIL: \"--busy-poll=\" requires US between 0 and 1000000\n");
+				usage();
+				rc = 1;
+				goto out;
+			}
+			busy_poll_ns = us * 1000LL;
+		} else if (strstr(arg, "--cpu=") == arg) {
+			long n;
+
+			if (parse_number(strchr(arg, '=') + 1, 0,
+					 CPU_SETSIZE - 1, &n) < 0) {
+				fprintf(stderr,
+					"FAIL: \"--cpu=\" requires N between 0 and %d\n",
+					CPU_SETSIZE - 1);
+				usage();
+				rc = 1;
+				goto out;
+			}
+			cpu = n;
+		} else if (strcmp(arg, "--rt") == 0)
+			rt_priority = DEFAULT_RT_PRIORITY;
+		else if (strstr(arg, "--rt=") == arg) {
+			long prio;
+
+			if (parse_number(strchr(arg, '=') + 1,
+					 sched_get_priority_min(SCHED_FIFO),
+					 sched_get_priority_max(SCHED_FIFO),
+					 &prio) < 0) {
+				fprintf(stderr,
+					"FAIL: \"--rt=\" requires a SCHED_FIFO PRIO between %d and %d\n",
+					sched_get_priority_min(SCHED_FIFO),
+					sched_get_priority_max(SCHED_FIFO));
+				usage();
+				rc = 1;
+				goto out;
+			}
+			rt_priority = prio;
 		} else if (strstr(arg, "--lock-fd=") == arg) {
 			char *fd = strchr(arg, '=') + 1;
 
@@ -279,14 +1036,23 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
-	dbus_error_init(&error);
+	if (setup_scheduling()) {
+		rc = 1;
+		goto out;
+	}
 
-	if (address != NULL)
-		connection = dbus_connection_open(address, &error);
-	else
-		connection = dbus_bus_get(type, &error);
+	if (trace_path) {
+		trace = trace_open(trace_path, "dbus_service", trace_sample);
+		if (trace == NULL) {
+			rc = 1;
+			goto out;
+		}
+	}
+
+	dbus_error_init(&error);
 
-	if (connection == NULL) {
+	client = dbus_client_open(address, type, &error);
+	if (client == NULL) {
 		fprintf(stderr,
 			"FAIL: Failed to open connection to \"%s\" message bus: %s\n",
 			address ? address :
@@ -295,14 +1061,26 @@ int main(int argc, char *argv[])
 		dbus_error_free(&error);
 		rc = 1;
 		goto out;
-	} else if (address != NULL)
-		dbus_bus_register(connection, &error);
+	}
+	connection = dbus_client_connection(client);
+	if (max_received_size >= 0)
+		dbus_connection_set_max_received_size(connection,
+						      max_received_size);
+	if (max_message_size >= 0)
+		dbus_connection_set_max_message_size(connection,
+						     max_message_size);
+	dbus_client_set_handler(client, handle_message, NULL);
 
 	rc = do_service();
 
 out:
-	if (connection)
-		dbus_connection_unref(connection);
+	dbus_client_close(client);
+	free(chunk_buf);
+
+	if (capture_close(capture) < 0 || capture_failed)
+		rc = 1;
+	if (trace_close(trace) < 0)
+		rc = 1;
 
 	unlock_fd();
 
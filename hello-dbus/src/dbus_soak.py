@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2013 Canonical, Ltd.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+"""Soak test of dbus_service's memory budget under sustained overload.
+
+Starts dbus_service with the memory limits of dbus_service.start on a private bus
+whose limits match the system bus, then keeps several clients flooding it
+with signals, windowed method calls, Batch calls and 1 MiB stream chunks for
+the whole duration. The service's resident set is sampled throughout and its
+peak (VmHWM) must stay under the budget of the architecture; the service must
+also still be connected at the end. Clients failing with LimitsExceeded or
+NoReply are expected under overload and only counted.
+"""
+
+import argparse
+import itertools
+import os
+import platform
+import shlex
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from dbus_bench import (PrivateBus, SERVICE_NAME, OBJECT_PATH, INTERFACE,
+                        PAYLOADS, SRC_DIR, BUS_CONFIG)
+
+START_SCRIPT = os.path.join(SRC_DIR, "..", "package-dir-fwk", "bin", "dbus_service.start")
+MEMORY_OPTIONS = ("--max-received-size=", "--max-message-size=")
+
+# Peak resident set of dbus_service in KiB, measured with this script, see
+# ../package-dir-fwk/meta/readme.md. armhf and i386 haven't been measured.
+BUDGETS_KIB = {
+    "amd64": 16384,
+}
+
+MACHINE_ARCHS = {
+    "x86_64": "amd64",
+    "armv7l": "armhf",
+    "armv8l": "armhf",
+    "i686": "i386",
+    "i586": "i386",
+    "i386": "i386",
+}
+
+# The default system bus limits
+SOAK_BUS_CONFIG = (BUS_CONFIG
+                   .replace(">1000000000<", ">133169152<")
+                   .replace(">134217728<", ">33554432<")
+                   .replace(">50000<", ">128<")
+                   .replace(">300000<", ">25000<"))
+
+WORKLOADS = [
+    ["--count=20000", OBJECT_PATH, INTERFACE + ".Signal"] + PAYLOADS["string-4096"],
+    ["--type=method_call", "--count=4000", "--window=64",
+     OBJECT_PATH, INTERFACE + ".Method"] + PAYLOADS["string-4096"],
+    ["--type=method_call", "--count=4096", "--batch=64", "--window=16",
+     OBJECT_PATH, INTERFACE + ".Method"] + PAYLOADS["int32"],
+    ["--stream=32M", "--chunk=1M", "--window=8", OBJECT_PATH, INTERFACE + ".Upload"],
+    ["--stream=32M", "--chunk=1M", "--window=8", OBJECT_PATH, INTERFACE + ".Download"],
+]
+
+
+def service_limits():
+    """Returns the memory limits that dbus_service.start passes to binaries
+    that support them"""
+    with open(START_SCRIPT) as f:
+        words = shlex.split(f.read(), comments=True)
+    return [w for w in words if w.startswith(MEMORY_OPTIONS)]
+
+
+def read_status_kib(pid, field):
+    with open("/proc/%d/status" % pid) as f:
+        for line in f:
+            if line.startswith(field + ":"):
+                return int(line.split()[1])
+    return None
+
+
+class Client(threading.Thread):
+    """Runs the workloads in turn, starting at first, until deadline"""
+
+    def __init__(self, args, address, first, deadline):
+        threading.Thread.__init__(self, daemon=True)
+        self.args = args
+        self.address = address
+        self.first = first
+        self.deadline = deadline
+        self.runs = 0
+        self.failures = 0
+
+    def run(self):
+        workloads = itertools.islice(itertools.cycle(WORKLOADS), self.first, None)
+        for workload in workloads:
+            if time.monotonic() >= self.deadline:
+                break
+            rc = subprocess.call(
+                [self.args.dbus_message, "--address=" + self.address,
+                 "--name=" + SERVICE_NAME] + workload,
+                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            self.runs += 1
+            if rc != 0:
+                self.failures += 1
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("--dbus-message", default=os.path.join(SRC_DIR, "dbus_message"))
+    parser.add_argument("--dbus-service", default=os.path.join(SRC_DIR, "dbus_service"))
+    parser.add_argument("--duration", type=float, default=60,
+                        help="seconds of overload (default 60)")
+    parser.add_argument("--clients", type=int, default=8,
+                        help="concurrent clients (default 8)")
+    parser.add_argument("--arch", default=MACHINE_ARCHS.get(platform.machine()),
+                        help="architecture whose budget applies (default: this one)")
+    parser.add_argument("--ceiling-kib", type=int,
+                        help="override the budget of the architecture")
+    args = parser.parse_args()
+
+    ceiling = args.ceiling_kib or BUDGETS_KIB.get(args.arch)
+    if ceiling is None:
+        print("FAIL: no memory budget for %s, use --ceiling-kib" % (args.arch or platform.machine()))
+        return 1
+
+    limits = service_limits()
+    if not limits:
+        print("FAIL: no memory limits in %s" % START_SCRIPT)
+        return 1
+    print("limits %s" % " ".join(limits))
+
+    with tempfile.TemporaryDirectory(prefix="dbus_soak.") as tmpdir:
+        report_path = os.path.join(tmpdir, "report")
+        with open(report_path, "w") as report:
+            bus = PrivateBus(tmpdir, args.dbus_service, limits + ["--report=5"],
+                             bus_config=SOAK_BUS_CONFIG, service_stdout=report)
+            try:
+                pid = bus.service.pid
+                idle_kib = read_status_kib(pid, "VmRSS")
+                deadline = time.monotonic() + args.duration
+                clients = [Client(args, bus.address, i, deadline)
+                           for i in range(args.clients)]
+                for c in clients:
+                    c.start()
+
+                peak_sampled = 0
+                while any(c.is_alive() for c in clients):
+                    if bus.service.poll() is not None:
+                        break
+                    peak_sampled = max(peak_sampled, read_status_kib(pid, "VmRSS") or 0)
+                    time.sleep(0.1)
+
+                alive = bus.service.poll() is None
+                hwm_kib = read_status_kib(pid, "VmHWM") if alive else None
+            finally:
+                bus.close()
+
+        with open(report_path) as f:
+            reports = [line.strip() for line in f if line.startswith("memory:")]
+
+    runs = sum(c.runs for c in clients)
+    failures = sum(c.failures for c in clients)
+    print("arch %s, budget %d KiB, %d clients for %.0f s" %
+          (args.arch, ceiling, args.clients, args.duration))
+    print("client runs %d, failed %d" % (runs, failures))
+    if reports:
+        print("last report: %s" % reports[-1])
+
+    if not alive:
+        print("FAIL: dbus_service exited with %d during the soak" % bus.service.returncode)
+        return 1
+    print("dbus_service RSS idle %d KiB, sampled peak %d KiB, VmHWM %d KiB" %
+          (idle_kib, peak_sampled, hwm_kib))
+    if runs == failures:
+        print("FAIL: every client run failed, the service wasn't loaded")
+        return 1
+    if hwm_kib > ceiling:
+        print("FAIL: VmHWM %d KiB is over the %d KiB budget" % (hwm_kib, ceiling))
+        return 1
+
+    print("PASS")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
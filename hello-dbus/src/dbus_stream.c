@@ -0,0 +1,59 @@
+/* dbus_stream.c
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "dbus_stream.h"
+
+#define ADLER_MOD 65521
+/* Largest n such that 255n(n+1)/2 + (n+1)(ADLER_MOD-1) fits in 32 bits */
+#define ADLER_NMAX 5552
+
+uint32_t stream_checksum(const unsigned char *data, size_t len)
+{
+	uint32_t a = 1, b = 0;
+
+	while (len > 0) {
+		size_t n = len < ADLER_NMAX ? len : ADLER_NMAX;
+
+		len -= n;
+		while (n--) {
+			a += *data++;
+			b += a;
+		}
+		a %= ADLER_MOD;
+		b %= ADLER_MOD;
+	}
+
+	return (b << 16) | a;
+}
+
+/**
+ * Fills data with the bytes at offset of an endless, position dependent
+ * pattern, so that misplaced chunks don't go unnoticed
+ */
+void stream_fill(unsigned char *data, uint64_t offset, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		uint64_t pos = offset + i;
+
+		data[i] = (unsigned char)(pos ^ (pos >> 8) ^ (pos >> 16));
+	}
+}
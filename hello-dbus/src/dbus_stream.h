@@ -0,0 +1,53 @@
+/* dbus_stream.h
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Chunked streams between dbus_message and dbus_service.
+ *
+ * A stream is split into chunks of at most STREAM_MAX_CHUNK bytes, each
+ * moved by its own method call, so no message comes near the bus's maximum
+ * message size and neither end holds more than the chunks in flight.
+ *
+ *   Upload(t stream, t offset, ay data, u checksum) -> (t received)
+ *	Chunks of a stream must arrive in order, starting at offset 0. The
+ *	reply carries the number of bytes received so far; an empty chunk
+ *	ends the stream.
+ *
+ *   Download(t offset, u length) -> (ay data, u checksum)
+ *	Returns length bytes of stream_fill() data starting at offset.
+ *
+ * checksum is the Adler-32 of data, as computed by stream_checksum().
+ */
+
+#ifndef DBUS_STREAM_H
+#define DBUS_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STREAM_UPLOAD "Upload"
+#define STREAM_DOWNLOAD "Download"
+
+#define STREAM_DEFAULT_CHUNK (64 * 1024)
+#define STREAM_MAX_CHUNK (16 * 1024 * 1024)
+
+uint32_t stream_checksum(const unsigned char *data, size_t len);
+void stream_fill(unsigned char *data, uint64_t offset, size_t len);
+
+#endif /* DBUS_STREAM_H */
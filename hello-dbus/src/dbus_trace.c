@@ -0,0 +1,101 @@
+/* dbus_trace.c
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "dbus_trace.h"
+
+#define TRACE_BUFSIZ (64 * 1024)
+
+struct trace_file {
+	FILE *file;
+	const char *path;
+	unsigned int sample;
+};
+
+trace_file *trace_open(const char *path, const char *program,
+		       unsigned int sample)
+{
+	trace_file *trace;
+
+	trace = calloc(1, sizeof(*trace));
+	if (trace == NULL) {
+		fprintf(stderr, "FAIL: Not enough memory\n");
+		return NULL;
+	}
+
+	trace->path = path;
+	trace->sample = sample ? sample : 1;
+	trace->file = fopen(path, "w");
+	if (trace->file == NULL) {
+		fprintf(stderr, "FAIL: Couldn't open trace file \"%s\": %m\n",
+			path);
+		free(trace);
+		return NULL;
+	}
+	setvbuf(trace->file, NULL, _IOFBF, TRACE_BUFSIZ);
+	fprintf(trace->file, "# dbus-trace 1 %s %d\n", program, getpid());
+
+	return trace;
+}
+
+/**
+ * Returns TRUE when the call with serial is to be traced. Serials start at
+ * 1, and 0 means the message hasn't been sent yet.
+ */
+int trace_sampled(trace_file * trace, dbus_uint32_t serial)
+{
+	return trace && serial && serial % trace->sample == 0;
+}
+
+void trace_event(trace_file * trace, const char *event, const char *client,
+		 dbus_uint32_t serial, long long timestamp_ns)
+{
+	if (!trace_sampled(trace, serial))
+		return;
+
+	fprintf(trace->file, "%s %s %u %lld\n", event, client ? client : "-",
+		serial, timestamp_ns);
+}
+
+/**
+ * Returns -1 if buffered events couldn't be written out
+ */
+int trace_close(trace_file * trace)
+{
+	int rc = 0;
+
+	if (trace == NULL)
+		return 0;
+
+	if (ferror(trace->file))
+		rc = -1;
+	if (fclose(trace->file) != 0)
+		rc = -1;
+	if (rc < 0)
+		fprintf(stderr, "FAIL: Couldn't write trace file \"%s\"\n",
+			trace->path);
+	free(trace);
+
+	return rc;
+}
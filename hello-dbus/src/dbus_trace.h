@@ -0,0 +1,57 @@
+/* dbus_trace.h
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Latency traces, written by dbus_message --trace and dbus_service --trace
+ * and joined by dbus_trace_merge.py.
+ *
+ * A trace file is text: a "# dbus-trace 1 <program> <pid>" line, then one
+ * "<event> <client> <serial> <timestamp_ns>" line per event, where client is
+ * the unique name of the calling connection, serial the serial of its call
+ * and timestamp_ns CLOCK_MONOTONIC, which all processes on a host share.
+ *
+ * Only calls whose serial is a multiple of the sampling rate are traced, so
+ * every process picks the same calls without coordinating.
+ */
+
+#ifndef DBUS_TRACE_H
+#define DBUS_TRACE_H
+
+#include <dbus/dbus.h>
+
+#define TRACE_CLIENT_SEND "client_send"
+#define TRACE_SERVICE_RECEIVE "service_receive"
+#define TRACE_HANDLER_START "handler_start"
+#define TRACE_HANDLER_END "handler_end"
+#define TRACE_REPLY_SEND "reply_send"
+#define TRACE_CLIENT_READ "client_read"
+#define TRACE_CLIENT_RECEIVE "client_receive"
+
+#define TRACE_DEFAULT_SAMPLE 100
+
+typedef struct trace_file trace_file;
+
+trace_file *trace_open(const char *path, const char *program,
+		       unsigned int sample);
+int trace_sampled(trace_file * trace, dbus_uint32_t serial);
+void trace_event(trace_file * trace, const char *event, const char *client,
+		 dbus_uint32_t serial, long long timestamp_ns);
+int trace_close(trace_file * trace);
+
+#endif /* DBUS_TRACE_H */
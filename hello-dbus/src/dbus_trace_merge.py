@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2013 Canonical, Ltd.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+"""Joins dbus_message and dbus_service --trace files into per call latency.
+
+Events are matched on the caller's unique name and the call serial (see
+dbus_trace.h), and each traced call is broken down into:
+
+  bus_in   client_send -> service_receive    client write, bus daemon, service read
+  queue    service_receive -> handler_start  waiting in the service's incoming queue
+  handler  handler_start -> handler_end      the service handler
+  reply    handler_end -> reply_send         the service writing its reply
+  bus_out  reply_send -> client_read         bus daemon, client read
+  client   client_read -> client_receive     waiting in the client's incoming queue
+  total    client_send -> client_receive
+
+All trace files must come from the same host, since CLOCK_MONOTONIC is only
+comparable within one boot. service_receive is when the read that queued the
+call returned; libdbus also reads while flushing replies, so a call read that
+way is stamped with the previous read and its time moves from bus_in to queue.
+Such stamps are clamped to client_send.
+"""
+
+import argparse
+import csv
+import sys
+
+PHASES = [
+    ("bus_in", "client_send", "service_receive"),
+    ("queue", "service_receive", "handler_start"),
+    ("handler", "handler_start", "handler_end"),
+    ("reply", "handler_end", "reply_send"),
+    ("bus_out", "reply_send", "client_read"),
+    ("client", "client_read", "client_receive"),
+    ("total", "client_send", "client_receive"),
+]
+
+
+def read_traces(paths):
+    """Returns {(client, serial): {event: timestamp_ns}}"""
+    calls = {}
+    for path in paths:
+        with open(path) as f:
+            for lineno, line in enumerate(f, 1):
+                if line.startswith("#") or not line.strip():
+                    continue
+                try:
+                    event, client, serial, timestamp = line.split()
+                    key = (client, int(serial))
+                    calls.setdefault(key, {})[event] = int(timestamp)
+                except ValueError:
+                    sys.exit("FAIL: %s:%d: malformed trace line" % (path, lineno))
+    return calls
+
+
+def breakdown(events):
+    """Returns {phase: us} for the phases whose two events were traced"""
+    if "client_send" in events and "service_receive" in events:
+        events["service_receive"] = max(events["service_receive"], events["client_send"])
+    result = {}
+    for phase, start, end in PHASES:
+        if start in events and end in events:
+            result[phase] = (events[end] - events[start]) / 1000.0
+    return result
+
+
+def percentile(sorted_values, p):
+    index = min(len(sorted_values) - 1, int(round(p / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+def print_summary(rows):
+    print("%-10s %8s %10s %10s %10s %10s" % ("phase", "calls", "mean us", "p50 us", "p90 us", "p99 us"))
+    for phase, _, _ in PHASES:
+        values = sorted(r[phase] for r in rows if phase in r)
+        if not values:
+            continue
+        print("%-10s %8d %10.1f %10.1f %10.1f %10.1f" %
+              (phase, len(values), sum(values) / len(values), percentile(values, 50),
+               percentile(values, 90), percentile(values, 99)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    parser.add_argument("traces", nargs="+", help="trace files of the client(s) and the service")
+    parser.add_argument("--csv", help="write the breakdown of every call to this file")
+    args = parser.parse_args()
+
+    calls = read_traces(args.traces)
+    rows = []
+    for (client, serial), events in sorted(calls.items()):
+        if "client_send" not in events or "handler_start" not in events:
+            continue
+        row = breakdown(events)
+        row["caller"] = client
+        row["serial"] = serial
+        rows.append(row)
+
+    if not rows:
+        sys.exit("FAIL: no call was traced by both ends")
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.DictWriter(f, ["caller", "serial"] + [p for p, _, _ in PHASES],
+                                    restval="")
+            writer.writeheader()
+            writer.writerows(rows)
+
+    print_summary(rows)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
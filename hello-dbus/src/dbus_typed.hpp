@@ -0,0 +1,379 @@
+/* dbus_typed.hpp
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Typed, header-only message builder for programs embedding the client.
+ *
+ * The D-Bus signature of the arguments is derived at compile time and the
+ * values are appended directly through DBusMessageIter, skipping the
+ * "type:value" string grammar handled by append_args(). For example:
+ *
+ *   std::map<std::string, int32_t> dict = {{"a", 1}};
+ *   std::vector<uint32_t> values = {1, 2, 3};
+ *
+ *   static_assert(dbus_typed::signature<int32_t, decltype(values),
+ *                 decltype(dict)>.view() == "iaua{si}");
+ *   dbus_typed::append(message, int32_t(42), values, dict);
+ *
+ * Supported types: bool, uint8_t, int16_t, uint16_t, int32_t, uint32_t,
+ * int64_t, uint64_t, double, std::string, std::string_view, const char *,
+ * dbus_typed::object_path, std::vector, std::array and std::map, keyed by
+ * any of the types before std::vector.
+ */
+
+#ifndef DBUS_TYPED_HPP
+#define DBUS_TYPED_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#include "dbus_common.h"
+
+namespace dbus_typed {
+
+/* NUL terminated string of a length known at compile time */
+template <std::size_t N> struct fixed_string {
+	char data[N + 1] = {};
+
+	constexpr fixed_string() = default;
+	constexpr fixed_string(const char (&str)[N + 1])
+	{
+		for (std::size_t i = 0; i < N; i++)
+			data[i] = str[i];
+	}
+
+	constexpr const char *c_str() const
+	{
+		return data;
+	}
+
+	constexpr std::string_view view() const
+	{
+		return std::string_view(data, N);
+	}
+};
+
+template <std::size_t N>
+fixed_string(const char (&)[N]) -> fixed_string<N - 1>;
+
+template <std::size_t A, std::size_t B>
+constexpr fixed_string<A + B> operator+(const fixed_string<A> &a,
+					 const fixed_string<B> &b)
+{
+	fixed_string<A + B> r;
+
+	for (std::size_t i = 0; i < A; i++)
+		r.data[i] = a.data[i];
+	for (std::size_t i = 0; i < B; i++)
+		r.data[A + i] = b.data[i];
+	return r;
+}
+
+constexpr fixed_string<1> sig_char(char c)
+{
+	fixed_string<1> r;
+
+	r.data[0] = c;
+	return r;
+}
+
+/* Strong type so object paths don't get marshalled as plain strings */
+struct object_path {
+	const char *value;
+};
+
+/* type_traits<T> provides the signature of T and appends a T to an iter.
+ * fixed is true for the types that dbus_message_iter_append_fixed_array()
+ * accepts with the same in-memory layout, basic for the types that can be
+ * dictionary keys.
+ */
+template <typename T, typename Enable = void> struct type_traits;
+
+template <typename T, int DBusType, char Code> struct basic_traits {
+	static constexpr fixed_string<1> sig = sig_char(Code);
+	static constexpr int dbus_type = DBusType;
+	static constexpr bool fixed = true;
+	static constexpr bool basic = true;
+
+	static bool append(DBusMessageIter *iter, const T &value)
+	{
+		return dbus_message_iter_append_basic(iter, DBusType, &value);
+	}
+};
+
+template <> struct type_traits<uint8_t>
+	: basic_traits<uint8_t, DBUS_TYPE_BYTE, DBUS_TYPE_BYTE_AS_STRING[0]> {};
+template <> struct type_traits<int16_t>
+	: basic_traits<int16_t, DBUS_TYPE_INT16, DBUS_TYPE_INT16_AS_STRING[0]> {};
+template <> struct type_traits<uint16_t>
+	: basic_traits<uint16_t, DBUS_TYPE_UINT16, DBUS_TYPE_UINT16_AS_STRING[0]> {};
+template <> struct type_traits<int32_t>
+	: basic_traits<int32_t, DBUS_TYPE_INT32, DBUS_TYPE_INT32_AS_STRING[0]> {};
+template <> struct type_traits<uint32_t>
+	: basic_traits<uint32_t, DBUS_TYPE_UINT32, DBUS_TYPE_UINT32_AS_STRING[0]> {};
+template <> struct type_traits<int64_t>
+	: basic_traits<int64_t, DBUS_TYPE_INT64, DBUS_TYPE_INT64_AS_STRING[0]> {};
+template <> struct type_traits<uint64_t>
+	: basic_traits<uint64_t, DBUS_TYPE_UINT64, DBUS_TYPE_UINT64_AS_STRING[0]> {};
+template <> struct type_traits<double>
+	: basic_traits<double, DBUS_TYPE_DOUBLE, DBUS_TYPE_DOUBLE_AS_STRING[0]> {};
+
+/* dbus_bool_t is 32 bits wide, so bool can't use the fixed array path */
+template <> struct type_traits<bool> {
+	static constexpr fixed_string<1> sig = sig_char(DBUS_TYPE_BOOLEAN_AS_STRING[0]);
+	static constexpr bool fixed = false;
+	static constexpr bool basic = true;
+
+	static bool append(DBusMessageIter *iter, bool value)
+	{
+		dbus_bool_t v = value ? TRUE : FALSE;
+
+		return dbus_message_iter_append_basic(iter, DBUS_TYPE_BOOLEAN, &v);
+	}
+};
+
+template <> struct type_traits<const char *> {
+	static constexpr fixed_string<1> sig = sig_char(DBUS_TYPE_STRING_AS_STRING[0]);
+	static constexpr bool fixed = false;
+	static constexpr bool basic = true;
+
+	static bool append(DBusMessageIter *iter, const char *value)
+	{
+		return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING,
+						      &value);
+	}
+};
+
+template <> struct type_traits<std::string> : type_traits<const char *> {
+	static bool append(DBusMessageIter *iter, const std::string &value)
+	{
+		return type_traits<const char *>::append(iter, value.c_str());
+	}
+};
+
+/* libdbus wants a NUL terminated string, which a string_view doesn't
+ * guarantee. Short values are terminated on the stack, long ones on the heap.
+ */
+template <> struct type_traits<std::string_view> : type_traits<const char *> {
+	static bool append(DBusMessageIter *iter, std::string_view value)
+	{
+		char buf[256];
+
+		if (value.size() < sizeof(buf)) {
+			value.copy(buf, value.size());
+			buf[value.size()] = '\0';
+			return type_traits<const char *>::append(iter, buf);
+		}
+		return type_traits<std::string>::append(iter,
+							std::string(value));
+	}
+};
+
+template <> struct type_traits<object_path> {
+	static constexpr fixed_string<1> sig = sig_char(DBUS_TYPE_OBJECT_PATH_AS_STRING[0]);
+	static constexpr bool fixed = false;
+	static constexpr bool basic = true;
+
+	static bool append(DBusMessageIter *iter, const object_path &value)
+	{
+		return dbus_message_iter_append_basic(iter,
+						      DBUS_TYPE_OBJECT_PATH,
+						      &value.value);
+	}
+};
+
+/* Arrays of any contiguous or iterable sequence of T */
+template <typename T> struct sequence_traits {
+	static constexpr fixed_string<1> array_sig = sig_char(DBUS_TYPE_ARRAY_AS_STRING[0]);
+	static constexpr auto sig = array_sig + type_traits<T>::sig;
+	static constexpr bool fixed = false;
+	static constexpr bool basic = false;
+
+	template <typename Seq>
+	static bool append(DBusMessageIter *iter, const Seq &values)
+	{
+		DBusMessageIter sub;
+		bool ok = true;
+
+		if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+						      type_traits<T>::sig.c_str(),
+						      &sub))
+			return false;
+
+		if constexpr (type_traits<T>::fixed) {
+			const T *data = values.data();
+
+			ok = dbus_message_iter_append_fixed_array(&sub,
+					type_traits<T>::dbus_type, &data,
+					(int)values.size());
+		} else {
+			for (const auto &value : values) {
+				if (!(ok = type_traits<T>::append(&sub, value)))
+					break;
+			}
+		}
+
+		if (!ok) {
+			dbus_message_iter_abandon_container(iter, &sub);
+			return false;
+		}
+		return dbus_message_iter_close_container(iter, &sub);
+	}
+};
+
+/* std::vector<bool> has no data(), so it always takes the element loop */
+template <typename T, typename A>
+struct type_traits<std::vector<T, A>> : sequence_traits<T> {
+	static bool append(DBusMessageIter *iter, const std::vector<T, A> &v)
+	{
+		if constexpr (std::is_same_v<T, bool>) {
+			DBusMessageIter sub;
+
+			if (!dbus_message_iter_open_container(iter,
+							      DBUS_TYPE_ARRAY,
+							      type_traits<bool>::sig.c_str(),
+							      &sub))
+				return false;
+			for (bool value : v) {
+				if (!type_traits<bool>::append(&sub, value)) {
+					dbus_message_iter_abandon_container(iter,
+									    &sub);
+					return false;
+				}
+			}
+			return dbus_message_iter_close_container(iter, &sub);
+		} else
+			return sequence_traits<T>::append(iter, v);
+	}
+};
+
+template <typename T, std::size_t N>
+struct type_traits<std::array<T, N>> : sequence_traits<T> {
+	static bool append(DBusMessageIter *iter, const std::array<T, N> &v)
+	{
+		return sequence_traits<T>::append(iter, v);
+	}
+};
+
+template <typename K, typename V, typename C, typename A>
+struct type_traits<std::map<K, V, C, A>> {
+	static_assert(type_traits<K>::basic,
+		      "D-Bus dictionary keys must be of a basic type");
+
+	static constexpr auto entry_sig =
+		sig_char(DBUS_DICT_ENTRY_BEGIN_CHAR) +
+		type_traits<K>::sig + type_traits<V>::sig +
+		sig_char(DBUS_DICT_ENTRY_END_CHAR);
+	static constexpr auto sig =
+		sig_char(DBUS_TYPE_ARRAY_AS_STRING[0]) + entry_sig;
+	static constexpr bool fixed = false;
+	static constexpr bool basic = false;
+
+	static bool append(DBusMessageIter *iter, const std::map<K, V, C, A> &m)
+	{
+		DBusMessageIter sub;
+
+		if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+						      entry_sig.c_str(), &sub))
+			return false;
+
+		for (const auto &kv : m) {
+			DBusMessageIter entry;
+
+			if (!dbus_message_iter_open_container(&sub,
+							      DBUS_TYPE_DICT_ENTRY,
+							      NULL, &entry))
+				goto fail;
+			if (!type_traits<K>::append(&entry, kv.first) ||
+			    !type_traits<V>::append(&entry, kv.second)) {
+				dbus_message_iter_abandon_container(&sub, &entry);
+				goto fail;
+			}
+			if (!dbus_message_iter_close_container(&sub, &entry))
+				goto fail;
+		}
+		return dbus_message_iter_close_container(iter, &sub);
+
+fail:
+		dbus_message_iter_abandon_container(iter, &sub);
+		return false;
+	}
+};
+
+/* String literals and char arrays decay to const char * */
+template <typename T>
+using traits_of = type_traits<std::conditional_t<
+	std::is_array_v<std::remove_reference_t<T>> ||
+	std::is_same_v<std::decay_t<T>, char *>,
+	const char *, std::remove_cv_t<std::remove_reference_t<T>>>>;
+
+/* Signature of a whole argument list, e.g. signature<int32_t, std::string> */
+template <typename... Args>
+inline constexpr auto signature = (fixed_string<0>() + ... + traits_of<Args>::sig);
+
+/**
+ * Appends args to the body of message, in order. Returns false when libdbus
+ * runs out of memory, in which case the message body is left incomplete.
+ */
+template <typename... Args>
+bool append(DBusMessage *message, const Args &... args)
+{
+	DBusMessageIter iter;
+
+	dbus_message_iter_init_append(message, &iter);
+	return (traits_of<Args>::append(&iter, args) && ...);
+}
+
+template <typename... Args>
+DBusMessage *new_signal(const char *path, const char *interface,
+			const char *member, const Args &... args)
+{
+	DBusMessage *message = dbus_message_new_signal(path, interface, member);
+
+	if (message && !append(message, args...)) {
+		dbus_message_unref(message);
+		return NULL;
+	}
+	return message;
+}
+
+template <typename... Args>
+DBusMessage *new_method_call(const char *destination, const char *path,
+			     const char *interface, const char *member,
+			     const Args &... args)
+{
+	DBusMessage *message = dbus_message_new_method_call(destination, path,
+							    interface, member);
+
+	if (message && !append(message, args...)) {
+		dbus_message_unref(message);
+		return NULL;
+	}
+	return message;
+}
+
+} /* namespace dbus_typed */
+
+#endif /* DBUS_TYPED_HPP */
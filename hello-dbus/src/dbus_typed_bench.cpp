@@ -0,0 +1,243 @@
+/* dbus_typed_bench.cpp  Compares the typed builder with the string-spec path
+ *
+ * Copyright (C) 2013 Canonical, Ltd.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <time.h>
+
+#include "dbus_typed.hpp"
+
+#define BENCH_PATH "/com/canonical/HelloDbusFramework/DbusSrv"
+#define BENCH_INTERFACE "com.canonical.HelloDbusFramework.DbusSrv"
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Builds the same message both ways: through append_args() from the
+ * command line grammar, and through dbus_typed::append() from native values.
+ * The spec strings are copied each iteration since append_args() consumes
+ * them, which is also what dbus_message pays for its argv.
+ */
+struct workload {
+	const char *name;
+	std::vector<std::string> spec;
+	DBusMessage *(*typed)(void);
+};
+
+static DBusMessage *new_message(void)
+{
+	return dbus_message_new_signal(BENCH_PATH, BENCH_INTERFACE, "Signal");
+}
+
+static DBusMessage *typed_scalars(void)
+{
+	DBusMessage *message = new_message();
+
+	dbus_typed::append(message, int32_t(42), uint64_t(1234567890123ULL),
+			   double(3.25), true, std::string_view("hello"));
+	return message;
+}
+
+static DBusMessage *typed_array(void)
+{
+	static const std::vector<int32_t> values = [] {
+		std::vector<int32_t> v;
+		for (int i = 0; i < 256; i++)
+			v.push_back(i);
+		return v;
+	}();
+	DBusMessage *message = new_message();
+
+	dbus_typed::append(message, values);
+	return message;
+}
+
+static DBusMessage *typed_dict(void)
+{
+	static const std::map<std::string, uint32_t> dict = [] {
+		std::map<std::string, uint32_t> m;
+		char key[16];
+
+		/* Zero padded so the map's order is the spec's order */
+		for (int i = 0; i < 16; i++) {
+			snprintf(key, sizeof(key), "key%02d", i);
+			m[key] = i;
+		}
+		return m;
+	}();
+	DBusMessage *message = new_message();
+
+	dbus_typed::append(message, dict);
+	return message;
+}
+
+static DBusMessage *string_spec(const std::vector<std::string> &spec)
+{
+	DBusMessage *message = new_message();
+	DBusMessageIter iter;
+	char buf[8192];
+	char *argv[16];
+	size_t off = 0;
+	int argc = 0;
+
+	for (const auto &s : spec) {
+		if (argc == (int)(sizeof(argv) / sizeof(argv[0])) ||
+		    s.size() + 1 > sizeof(buf) - off) {
+			fprintf(stderr, "FAIL: spec of %zu arguments is too long\n",
+				spec.size());
+			exit(1);
+		}
+		memcpy(buf + off, s.c_str(), s.size() + 1);
+		argv[argc++] = buf + off;
+		off += s.size() + 1;
+	}
+
+	dbus_message_iter_init_append(message, &iter);
+	if (append_args(&iter, argc, argv))
+		exit(1);
+	return message;
+}
+
+static std::string joined(const char *prefix, int n, const char *fmt)
+{
+	std::string s = prefix;
+	char item[64];
+
+	for (int i = 0; i < n; i++) {
+		snprintf(item, sizeof(item), fmt, i, i);
+		if (i)
+			s += ",";
+		s += item;
+	}
+	return s;
+}
+
+/* Both builders must produce the same wire format, header and body */
+static void check_same(const char *name, DBusMessage *a, DBusMessage *b)
+{
+	char *a_bytes, *b_bytes;
+	int a_len, b_len;
+
+	if (strcmp(dbus_message_get_signature(a),
+		   dbus_message_get_signature(b))) {
+		fprintf(stderr, "FAIL: %s: signature mismatch \"%s\" != \"%s\"\n",
+			name, dbus_message_get_signature(a),
+			dbus_message_get_signature(b));
+		exit(1);
+	}
+
+	dbus_message_set_serial(a, 1);
+	dbus_message_set_serial(b, 1);
+	if (!dbus_message_marshal(a, &a_bytes, &a_len) ||
+	    !dbus_message_marshal(b, &b_bytes, &b_len)) {
+		fprintf(stderr, "FAIL: %s: out of memory\n", name);
+		exit(1);
+	}
+	if (a_len != b_len || memcmp(a_bytes, b_bytes, a_len)) {
+		fprintf(stderr, "FAIL: %s: marshalled messages differ (%d and %d bytes)\n",
+			name, a_len, b_len);
+		exit(1);
+	}
+	dbus_free(a_bytes);
+	dbus_free(b_bytes);
+}
+
+static void usage(int ecode)
+{
+	fprintf(stderr,
+		"Usage: dbus_typed_bench [N]\n"
+		"    N\t\t\titerations of each benchmark, above 0 (default 100000)\n");
+	exit(ecode);
+}
+
+int main(int argc, char *argv[])
+{
+	long iterations = 100000;
+	workload workloads[] = {
+		{"scalars",
+		 {"int32:42", "uint64:1234567890123", "double:3.25",
+		  "boolean:true", "string:hello"},
+		 typed_scalars},
+		{"array:int32[256]", {joined("array:int32:", 256, "%d")},
+		 typed_array},
+		{"dict:string:uint32[16]",
+		 {joined("dict:string:uint32:", 16, "key%02d,%d")},
+		 typed_dict},
+	};
+
+	if (argc > 2)
+		usage(1);
+	if (argc == 2) {
+		char *end;
+
+		errno = 0;
+		iterations = strtol(argv[1], &end, 10);
+		if (errno || end == argv[1] || *end != '\0' || iterations <= 0)
+			usage(1);
+	}
+
+	static_assert(dbus_typed::signature<int32_t, uint64_t, double, bool,
+		      std::string_view>.view() == "itdbs");
+	static_assert(dbus_typed::signature<std::map<std::string,
+		      uint32_t>>.view() == "a{su}");
+
+	double start = now_ns();
+
+	for (long i = 0; i < iterations; i++)
+		dbus_message_unref(new_message());
+	printf("empty message (included below): %.1f ns/op\n\n",
+	       (now_ns() - start) / iterations);
+
+	printf("%-24s %12s %12s %8s\n", "workload", "spec ns/op", "typed ns/op",
+	       "speedup");
+
+	for (auto &w : workloads) {
+		DBusMessage *a = string_spec(w.spec);
+		DBusMessage *b = w.typed();
+		double spec_ns, typed_ns;
+
+		check_same(w.name, a, b);
+		dbus_message_unref(a);
+		dbus_message_unref(b);
+
+		start = now_ns();
+		for (long i = 0; i < iterations; i++)
+			dbus_message_unref(string_spec(w.spec));
+		spec_ns = (now_ns() - start) / iterations;
+
+		start = now_ns();
+		for (long i = 0; i < iterations; i++)
+			dbus_message_unref(w.typed());
+		typed_ns = (now_ns() - start) / iterations;
+
+		printf("%-24s %12.1f %12.1f %7.2fx\n", w.name, spec_ns, typed_ns,
+		       spec_ns / typed_ns);
+	}
+
+	return 0;
+}